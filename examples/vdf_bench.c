@@ -0,0 +1,891 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Micro benchmarks for the libvdf read path.
+
+	usage: vdf_bench [benchmark...]
+
+	With no arguments, all benchmarks are run.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <vdf.h>
+
+#define FILES_PER_DIR		256
+#define LOOKUP_READS		200000
+#define SEQ_REQUEST			4096
+#define SEQ_BYTES			(256ULL * 1024 * 1024)
+#define REAL_FILE_SIZE		(64 * 1024 * 1024)
+#define REAL_REQUEST		(128 * 1024)
+#define REAL_PASSES			8
+#define META_FILES			100000
+#define SMALL_FILES			4000
+#define SMALL_SIZE			6000
+#define SMALL_REQUEST		(1024 * 1024)
+#define ASYNC_FILES			64
+#define ASYNC_SIZE			(32 * 1024)
+#define ASYNC_LATENCY		1000
+#define FATGEN_REQUEST		(1024 * 1024)
+#define SPARSE_FILES		2000
+#define SPARSE_SIZE			100
+#define SPARSE_REQUEST		4096
+#define BIGDIR_READS		20000
+#define POPULATE_DIRS		16
+#define PATH_FILES			100000
+#define PATH_FANOUT			16
+#define PATH_LOOKUPS		1000000
+#define META_PASSES			20
+#define IMPORT_DIRS			200
+#define IMPORT_FILES		250
+#define AUTOSIZE_FILES		100000
+#define AUTOSIZE_FILESIZE	(64 * 1024)
+
+/* FAT32 drives created without VDF_ALIGN_CLUSTER always have 32 reserved sectors */
+#define FAT32_RESERVED		32
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int zero_cback(vdf_file_cmd cmd, vdf_file *file, fileoff_t off, filesz_t len, void *buf, void *param) {
+	memset(buf, 0, len);
+	return len;
+}
+
+/* create a FAT32 drive holding 'cnt' single cluster virtual files */
+static vdf_drive *make_drive(int cnt) {
+	vdf_drive *drv;
+	vdf_file *dir = NULL;
+	char name[32];
+	uint64_t size;
+	int i;
+
+	size = ((uint64_t)cnt + (cnt / FILES_PER_DIR) + 1024) * 4096 * 11 / 10;
+	if(size < 300ULL * 1024 * 1024)
+		size = 300ULL * 1024 * 1024;
+	drv = vdf_drive_create(size, VDF_FAT32);
+	if(drv == NULL) {
+		perror("vdf_drive_create");
+		exit(1);
+	}
+	for(i=0; i<cnt; i++) {
+		if((i % FILES_PER_DIR) == 0) {
+			sprintf(name, "D%06d", i / FILES_PER_DIR);
+			dir = vdf_add_dir(vdf_drive_root(drv), name);
+		}
+		sprintf(name, "F%06d", i);
+		if(vdf_add_file_virt(dir, name, 1, zero_cback, NULL, 0) == NULL) {
+			perror("vdf_add_file_virt");
+			exit(1);
+		}
+	}
+	if(vdf_drive_lock(drv) == -1) {
+		perror("vdf_drive_lock");
+		exit(1);
+	}
+	return drv;
+}
+
+static void bench_lookup(void) {
+	static const int counts[] = { 1000, 10000, 100000, 500000, 0 };
+	vdf_drive *drv;
+	char *buff;
+	sector_t data_start, used, fat_ents;
+	ssize_t bps;
+	int spc, i, c;
+	double t, data_ns, fat_ns;
+
+	printf("lookup: cost of mapping a random sector to its file\n");
+	printf("  %8s %14s %14s\n", "files", "data ns/read", "FAT ns/read");
+	for(c=0; counts[c] != 0; c++) {
+		drv = make_drive(counts[c]);
+		bps = vdf_drive_sectorsize(drv);
+		spc = vdf_drive_clustersectors(drv);
+		buff = malloc(bps);
+		data_start = vdf_drive_sectors(drv) - (vdf_drive_dataclusters(drv) * spc);
+		used = vdf_drive_usedclusters(drv) * spc;
+		fat_ents = vdf_drive_usedclusters(drv) + 2;
+
+		srand(1);
+		t = now();
+		for(i=0; i<LOOKUP_READS; i++)
+			vdf_read_sector(drv, data_start + (rand() % used), buff);
+		data_ns = (now() - t) * 1e9 / LOOKUP_READS;
+
+		t = now();
+		for(i=0; i<LOOKUP_READS; i++)
+			vdf_read_sector(drv, FAT32_RESERVED + ((rand() % fat_ents) * 4 / bps), buff);
+		fat_ns = (now() - t) * 1e9 / LOOKUP_READS;
+
+		printf("  %8d %14.1f %14.1f\n", counts[c], data_ns, fat_ns);
+		free(buff);
+		vdf_drive_unlock(drv);
+		vdf_drive_free(drv);
+	}
+}
+
+/* stream the start of the drive in NBD sized requests, as a transport client would */
+static void bench_sequential(void) {
+	static const int counts[] = { 1000, 100000, 0 };
+	vdf_drive *drv;
+	vdf_read_ctx *ctx;
+	char *buff;
+	driveoff_t off, end;
+	double t, plain_ns, ctx_ns;
+	int c, reqs;
+
+	printf("sequential: cost of a %d byte request while streaming the drive\n", SEQ_REQUEST);
+	printf("  %8s %14s %14s\n", "files", "plain ns/req", "ctx ns/req");
+	buff = malloc(SEQ_REQUEST);
+	for(c=0; counts[c] != 0; c++) {
+		drv = make_drive(counts[c]);
+		end = (driveoff_t)vdf_drive_sectors(drv) * vdf_drive_sectorsize(drv);
+		if(end > SEQ_BYTES)
+			end = SEQ_BYTES;
+		reqs = end / SEQ_REQUEST;
+
+		t = now();
+		for(off=0; off<end; off+=SEQ_REQUEST)
+			vdf_read_bytes(drv, off, SEQ_REQUEST, buff);
+		plain_ns = (now() - t) * 1e9 / reqs;
+
+		ctx = vdf_read_ctx_create(drv);
+		t = now();
+		for(off=0; off<end; off+=SEQ_REQUEST)
+			vdf_read_bytes_ctx(ctx, off, SEQ_REQUEST, buff);
+		ctx_ns = (now() - t) * 1e9 / reqs;
+		vdf_read_ctx_free(ctx);
+
+		printf("  %8d %14.1f %14.1f\n", counts[c], plain_ns, ctx_ns);
+		vdf_drive_unlock(drv);
+		vdf_drive_free(drv);
+	}
+	free(buff);
+}
+
+/* read a cached real file through the drive, with and without VAF_MMAP */
+static void bench_realfile(void) {
+	static const struct {
+		const char *name;
+		int flags;
+	} modes[] = {
+		{ "read",	0 },
+		{ "mmap",	VAF_MMAP },
+		{ NULL,		0 }
+	};
+	char path[] = "/tmp/vdf_benchXXXXXX";
+	vdf_drive *drv;
+	vdf_read_ctx *ctx;
+	char *buff;
+	FILE *f;
+	driveoff_t off, end;
+	double t;
+	int fd, m, p;
+
+	fd = mkstemp(path);
+	if(fd == -1) {
+		perror("mkstemp");
+		return;
+	}
+	buff = malloc(REAL_REQUEST);
+	memset(buff, 0xa5, REAL_REQUEST);
+	f = fdopen(fd, "wb");
+	for(p=0; p<(REAL_FILE_SIZE / REAL_REQUEST); p++)
+		fwrite(buff, REAL_REQUEST, 1, f);
+	fclose(f);
+
+	printf("realfile: streaming a %d MiB real file in %d KiB requests\n", REAL_FILE_SIZE >> 20, REAL_REQUEST >> 10);
+	printf("  %8s %14s\n", "mode", "MiB/s");
+	for(m=0; modes[m].name != NULL; m++) {
+		drv = vdf_drive_create(REAL_FILE_SIZE * 2ULL, VDF_FAT32);
+		vdf_add_file_real(vdf_drive_root(drv), "DATA.BIN", path, modes[m].flags);
+		vdf_drive_lock(drv);
+		ctx = vdf_read_ctx_create(drv);
+		end = (driveoff_t)vdf_drive_sectors(drv) * vdf_drive_sectorsize(drv);
+		t = now();
+		for(p=0; p<REAL_PASSES; p++) {
+			for(off=0; off<end; off+=REAL_REQUEST)
+				vdf_read_bytes_ctx(ctx, off, REAL_REQUEST, buff);
+		}
+		t = now() - t;
+		printf("  %8s %14.1f\n", modes[m].name, ((double)end * REAL_PASSES / (1024 * 1024)) / t);
+		vdf_read_ctx_free(ctx);
+		vdf_drive_unlock(drv);
+		vdf_drive_free(drv);
+	}
+	unlink(path);
+	free(buff);
+}
+
+/* re-read the FATs and first directory clusters, as an OS client does while browsing */
+static void bench_meta(void) {
+	static const size_t sizes[] = { 0, 1024 * 1024, 64 * 1024 * 1024, 1 };
+	vdf_drive *drv;
+	char *buff;
+	sector_t end, s;
+	ssize_t bps;
+	uint64_t hits, misses, hits2, misses2;
+	double t;
+	int c, p;
+
+	printf("meta: re-reading the metadata of a %d file drive %d times\n", META_FILES, META_PASSES);
+	printf("  %10s %14s %12s %12s\n", "cache KiB", "MiB/s", "hits", "misses");
+	drv = make_drive(META_FILES);
+	bps = vdf_drive_sectorsize(drv);
+	buff = malloc(bps * 64);
+	/* FATs plus the first 1024 data sectors, which hold the root and first directories */
+	end = vdf_drive_sectors(drv) - (vdf_drive_dataclusters(drv) * vdf_drive_clustersectors(drv)) + 1024;
+	for(c=0; sizes[c] != 1; c++) {
+		vdf_set_drive_meta_cache(drv, sizes[c]);
+		vdf_get_drive_meta_cache_stats(drv, &hits, &misses);
+		t = now();
+		for(p=0; p<META_PASSES; p++) {
+			for(s=0; s<end; s+=64)
+				vdf_read_sectors(drv, s, 64, buff);
+		}
+		t = now() - t;
+		vdf_get_drive_meta_cache_stats(drv, &hits2, &misses2);
+		printf("  %10zu %14.1f %12llu %12llu\n", sizes[c] >> 10,
+			((double)end * bps * META_PASSES / (1024 * 1024)) / t,
+			(unsigned long long)(hits2 - hits), (unsigned long long)(misses2 - misses));
+	}
+	free(buff);
+	vdf_drive_unlock(drv);
+	vdf_drive_free(drv);
+}
+
+/* stream a drive made of many small real files in large requests */
+static void bench_smallfiles(void) {
+	char dir[] = "/tmp/vdf_benchXXXXXX";
+	char path[64], name[16];
+	vdf_drive *drv;
+	vdf_read_ctx *ctx;
+	char *buff;
+	FILE *f;
+	driveoff_t off, end;
+	double t;
+	int i;
+
+	if(mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return;
+	}
+	buff = malloc(SMALL_REQUEST);
+	memset(buff, 0x5a, SMALL_SIZE);
+	drv = vdf_drive_create(300ULL * 1024 * 1024, VDF_FAT32);
+	for(i=0; i<SMALL_FILES; i++) {
+		sprintf(path, "%s/%d", dir, i);
+		f = fopen(path, "wb");
+		fwrite(buff, SMALL_SIZE, 1, f);
+		fclose(f);
+		sprintf(name, "F%06d", i);
+		vdf_add_file_real(vdf_drive_root(drv), name, path, 0);
+	}
+	vdf_drive_lock(drv);
+	ctx = vdf_read_ctx_create(drv);
+	end = (driveoff_t)vdf_drive_usedclusters(drv) * vdf_drive_clustersectors(drv) * vdf_drive_sectorsize(drv);
+
+	printf("smallfiles: streaming %d real %d byte files in %d KiB requests\n", SMALL_FILES, SMALL_SIZE, SMALL_REQUEST >> 10);
+	t = now();
+	for(off=0; off<end; off+=SMALL_REQUEST)
+		vdf_read_bytes_ctx(ctx, off, SMALL_REQUEST, buff);
+	t = now() - t;
+	printf("  %14.1f files/s\n", SMALL_FILES / t);
+
+	vdf_read_ctx_free(ctx);
+	vdf_drive_unlock(drv);
+	vdf_drive_free(drv);
+	for(i=0; i<SMALL_FILES; i++) {
+		sprintf(path, "%s/%d", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+	free(buff);
+}
+
+/* a provider that pays ASYNC_LATENCY microseconds for every fetch, as a network source would */
+static int slow_cback(vdf_file_cmd cmd, vdf_file *file, fileoff_t off, filesz_t len, void *buf, void *param) {
+	usleep(ASYNC_LATENCY);
+	memset(buf, 0x33, len);
+	return len;
+}
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static vdf_file_request *async_queue[ASYNC_FILES];
+static int async_queued, async_stop;
+
+static int slow_async_cback(vdf_file_request *req, void *param) {
+	pthread_mutex_lock(&async_lock);
+	async_queue[async_queued++] = req;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+	return 0;
+}
+
+/* fetches everything that has been queued in one go */
+static void *async_provider(void *arg) {
+	vdf_file_request *reqs[ASYNC_FILES];
+	int cnt, i, r;
+
+	pthread_mutex_lock(&async_lock);
+	while(!async_stop) {
+		if(async_queued == 0) {
+			pthread_cond_wait(&async_cond, &async_lock);
+			continue;
+		}
+		cnt = async_queued;
+		memcpy(reqs, async_queue, cnt * sizeof(vdf_file_request*));
+		async_queued = 0;
+		pthread_mutex_unlock(&async_lock);
+		usleep(ASYNC_LATENCY);
+		for(i=0; i<cnt; i++) {
+			for(r=0; r<reqs[i]->cnt; r++)
+				memset(reqs[i]->ranges[r].buf, 0x33, reqs[i]->ranges[r].len);
+			reqs[i]->complete(reqs[i], 0);
+		}
+		pthread_mutex_lock(&async_lock);
+	}
+	pthread_mutex_unlock(&async_lock);
+	return NULL;
+}
+
+/* read a drive of slow virtual files with the synchronous and asynchronous callbacks */
+static void bench_async(void) {
+	vdf_drive *drv;
+	vdf_read_ctx *ctx;
+	pthread_t thread;
+	char *buff, name[16];
+	driveoff_t end;
+	double t;
+	int m, i;
+
+	printf("async: reading %d virtual files with %dus fetch latency\n", ASYNC_FILES, ASYNC_LATENCY);
+	printf("  %8s %14s\n", "mode", "ms/pass");
+	pthread_create(&thread, NULL, async_provider, NULL);
+	buff = malloc((size_t)ASYNC_FILES * ASYNC_SIZE);
+	for(m=0; m<2; m++) {
+		drv = vdf_drive_create(64ULL * 1024 * 1024, VDF_FAT16);
+		for(i=0; i<ASYNC_FILES; i++) {
+			sprintf(name, "F%06d", i);
+			if(m == 0)
+				vdf_add_file_virt(vdf_drive_root(drv), name, ASYNC_SIZE, slow_cback, NULL, 0);
+			else
+				vdf_add_file_async(vdf_drive_root(drv), name, ASYNC_SIZE, slow_async_cback, NULL, 0);
+		}
+		vdf_drive_lock(drv);
+		ctx = vdf_read_ctx_create(drv);
+		end = (driveoff_t)vdf_drive_sectors(drv) * vdf_drive_sectorsize(drv) - ((driveoff_t)vdf_drive_dataclusters(drv) * vdf_drive_clustersectors(drv) * vdf_drive_sectorsize(drv));
+		t = now();
+		vdf_read_bytes_ctx(ctx, end, (size_t)ASYNC_FILES * ASYNC_SIZE, buff);
+		t = now() - t;
+		printf("  %8s %14.1f\n", m ? "async" : "sync", t * 1000);
+		vdf_read_ctx_free(ctx);
+		vdf_drive_unlock(drv);
+		vdf_drive_free(drv);
+	}
+	pthread_mutex_lock(&async_lock);
+	async_stop = 1;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+	pthread_join(thread, NULL);
+	free(buff);
+}
+
+/*
+	read the whole first FAT of drives filled with files, with the metadata cache off.
+	A FAT12 FAT is only a few KiB so it is read many times over.
+*/
+static void bench_fatgen(void) {
+	static const struct {
+		uint64_t size;
+		int flags;
+		uint32_t file_size;
+		int passes;
+	} drives[] = {
+		{ 8 << 20,		VDF_FAT12,	512 << 10,		20000 },
+		{ 4ULL << 30,	VDF_FAT16,	64 << 20,		1 },
+		{ 1ULL << 40,	VDF_FAT32,	4000U << 20,	1 },
+		{ 0,			0,			0,				0 }
+	};
+	vdf_drive *drv;
+	vdf_read_ctx *ctx;
+	char *buff, name[16];
+	uint64_t fat_bytes, off, done, want;
+	int d, i, p;
+	double t;
+
+	printf("fatgen: generating the FAT of drives full of files\n");
+	printf("  %8s %14s %10s\n", "fs", "FAT KiB", "GB/s");
+	buff = malloc(FATGEN_REQUEST);
+	for(d=0; drives[d].size != 0; d++) {
+		drv = vdf_drive_create(drives[d].size, drives[d].flags);
+		if(drv == NULL) {
+			perror("vdf_drive_create");
+			continue;
+		}
+		for(i=0; ((uint64_t)(i + 1) * drives[d].file_size) < (drives[d].size - (drives[d].size / 64)); i++) {
+			sprintf(name, "F%06d", i);
+			vdf_add_file_virt(vdf_drive_root(drv), name, drives[d].file_size, zero_cback, NULL, 0);
+		}
+		vdf_set_drive_meta_cache(drv, 0);
+		vdf_drive_lock(drv);
+		ctx = vdf_read_ctx_create(drv);
+		fat_bytes = vdf_drive_dataclusters(drv) + 2;
+		if(drives[d].flags == VDF_FAT12)
+			fat_bytes = (fat_bytes * 3 + 1) / 2;
+		else
+			fat_bytes *= (drives[d].flags == VDF_FAT32 ? 4 : 2);
+		/* the first FAT starts after the reserved sectors */
+		off = (drives[d].flags == VDF_FAT32 ? FAT32_RESERVED : 1) * vdf_drive_sectorsize(drv);
+		done = 0;
+		t = now();
+		for(p=0; p<drives[d].passes; p++) {
+			for(i=0; (uint64_t)i * FATGEN_REQUEST < fat_bytes; i++) {
+				want = fat_bytes - (uint64_t)i * FATGEN_REQUEST;
+				if(want > FATGEN_REQUEST)
+					want = FATGEN_REQUEST;
+				vdf_read_bytes_ctx(ctx, off + (uint64_t)i * FATGEN_REQUEST, want, buff);
+				done += want;
+			}
+		}
+		t = now() - t;
+		printf("  %8s %14.1f %10.2f\n", vdf_filesystem_name(vdf_drive_filesystem(drv)),
+			fat_bytes / 1024.0, done / t / 1e9);
+		vdf_read_ctx_free(ctx);
+		vdf_drive_unlock(drv);
+		vdf_drive_free(drv);
+	}
+	free(buff);
+}
+
+/* stream a mostly empty drive: tiny files in large clusters and lots of free space */
+static void bench_sparse(void) {
+	vdf_drive *drv;
+	vdf_read_ctx *ctx;
+	char *buff, name[16];
+	uint64_t off, bytes;
+	int i;
+	double t;
+
+	printf("sparse: streaming a 4GiB FAT32 drive holding %d %d byte files\n", SPARSE_FILES, SPARSE_SIZE);
+	buff = malloc(SPARSE_REQUEST);
+	drv = vdf_drive_create(4ULL << 30, VDF_FAT32);
+	for(i=0; i<SPARSE_FILES; i++) {
+		sprintf(name, "F%06d", i);
+		vdf_add_file_virt(vdf_drive_root(drv), name, SPARSE_SIZE, zero_cback, NULL, 0);
+	}
+	vdf_set_drive_meta_cache(drv, 0);
+	vdf_drive_lock(drv);
+	ctx = vdf_read_ctx_create(drv);
+	bytes = vdf_drive_bytes(drv);
+	t = now();
+	for(off=0; off<bytes; off+=SPARSE_REQUEST)
+		vdf_read_bytes_ctx(ctx, off, SPARSE_REQUEST, buff);
+	t = now() - t;
+	printf("  %10.2f GB/s\n", bytes / t / 1e9);
+	vdf_read_ctx_free(ctx);
+	vdf_drive_unlock(drv);
+	vdf_drive_free(drv);
+	free(buff);
+}
+
+/* random sectors of one huge directory, generated on every read or copied from VDF_DIR_BLOBS */
+static void bench_bigdir(void) {
+	static const int counts[] = { 1000, 10000, 50000, 0 };
+	vdf_drive *drv;
+	char *buff, name[48];
+	sector_t data_start, used;
+	ssize_t bps;
+	int spc, i, c, b;
+	double t, ns[2];
+
+	printf("bigdir: cost of reading a random sector of a single large directory\n");
+	printf("  %8s %14s %14s\n", "entries", "ns/read", "blobs ns/read");
+	for(c=0; counts[c] != 0; c++) {
+		for(b=0; b<2; b++) {
+			drv = vdf_drive_create(1ULL << 30, VDF_FAT32 | VDF_VFAT | (b ? VDF_DIR_BLOBS : 0));
+			for(i=0; i<counts[c]; i++) {
+				sprintf(name, "A rather long file name %08d.txt", i);
+				vdf_add_file_virt(vdf_drive_root(drv), name, 0, zero_cback, NULL, 0);
+			}
+			vdf_set_drive_meta_cache(drv, 0);
+			vdf_drive_lock(drv);
+			bps = vdf_drive_sectorsize(drv);
+			spc = vdf_drive_clustersectors(drv);
+			buff = malloc(bps);
+			data_start = vdf_drive_sectors(drv) - (vdf_drive_dataclusters(drv) * spc);
+			used = vdf_drive_usedclusters(drv) * spc;
+
+			srand(1);
+			t = now();
+			for(i=0; i<BIGDIR_READS; i++)
+				vdf_read_sector(drv, data_start + (rand() % used), buff);
+			ns[b] = (now() - t) * 1e9 / BIGDIR_READS;
+			free(buff);
+			vdf_drive_unlock(drv);
+			vdf_drive_free(drv);
+		}
+		printf("  %8d %14.1f %14.1f\n", counts[c], ns[0], ns[1]);
+	}
+}
+
+/* adding files to a drive, every one of which is checked against its directory for a duplicate name */
+static void bench_populate(void) {
+	static const int counts[] = { 10000, 100000, 1000000, 0 };
+	vdf_drive *drv;
+	vdf_file *dirs[POPULATE_DIRS];
+	char name[32];
+	int i, c;
+	double t, ns[2];
+
+	printf("populate: cost of adding a file to a drive (8.3 names)\n");
+	printf("  %8s %14s %14s\n", "files", "one dir ns", "16 dirs ns");
+	for(c=0; counts[c] != 0; c++) {
+		drv = vdf_drive_create(1ULL << 30, VDF_FAT32);
+		t = now();
+		for(i=0; i<counts[c]; i++) {
+			sprintf(name, "F%07d.DAT", i);
+			if(vdf_add_file_virt(vdf_drive_root(drv), name, 0, zero_cback, NULL, 0) == NULL) {
+				perror("vdf_add_file_virt");
+				exit(1);
+			}
+		}
+		ns[0] = (now() - t) * 1e9 / counts[c];
+		vdf_drive_free(drv);
+
+		drv = vdf_drive_create(1ULL << 30, VDF_FAT32);
+		for(i=0; i<POPULATE_DIRS; i++) {
+			sprintf(name, "D%02d", i);
+			dirs[i] = vdf_add_dir(vdf_drive_root(drv), name);
+		}
+		t = now();
+		for(i=0; i<counts[c]; i++) {
+			sprintf(name, "F%07d.DAT", i);
+			if(vdf_add_file_virt(dirs[i % POPULATE_DIRS], name, 0, zero_cback, NULL, 0) == NULL) {
+				perror("vdf_add_file_virt");
+				exit(1);
+			}
+		}
+		ns[1] = (now() - t) * 1e9 / counts[c];
+		vdf_drive_free(drv);
+		printf("  %8d %14.1f %14.1f\n", counts[c], ns[0], ns[1]);
+	}
+}
+
+/* camera dump style names, every one of which needs a numeric tail on its short name */
+static void bench_tails(void) {
+	static const int counts[] = { 1000, 10000, 50000, 0 };
+	vdf_drive *drv;
+	char name[32];
+	int i, c;
+	double t;
+
+	printf("tails: cost of adding a file whose short name needs a numeric tail\n");
+	printf("  %8s %14s\n", "files", "ns/file");
+	for(c=0; counts[c] != 0; c++) {
+		drv = vdf_drive_create(1ULL << 30, VDF_FAT32 | VDF_VFAT);
+		t = now();
+		for(i=0; i<counts[c]; i++) {
+			sprintf(name, "IMG_%05d.JPEG", i);
+			if(vdf_add_file_virt(vdf_drive_root(drv), name, 0, zero_cback, NULL, 0) == NULL) {
+				perror("vdf_add_file_virt");
+				exit(1);
+			}
+		}
+		t = (now() - t) * 1e9 / counts[c];
+		vdf_drive_free(drv);
+		printf("  %8d %14.1f\n", counts[c], t);
+	}
+}
+
+/* vdf_find_path() over a three level tree, for a working set that fits the path cache and one that doesn't */
+static void bench_paths(void) {
+	static const int sets[] = { 256, PATH_FILES, 0 };
+	vdf_drive *drv;
+	vdf_file *top, *sub[PATH_FANOUT * PATH_FANOUT];
+	char **paths, name[64];
+	int i, j, c;
+	double t;
+
+	drv = vdf_drive_create(1ULL << 30, VDF_FAT32 | VDF_VFAT);
+	for(i=0; i<PATH_FANOUT; i++) {
+		sprintf(name, "Top level directory %d", i);
+		top = vdf_add_dir(vdf_drive_root(drv), name);
+		for(j=0; j<PATH_FANOUT; j++) {
+			sprintf(name, "Second level directory %d", j);
+			sub[(i * PATH_FANOUT) + j] = vdf_add_dir(top, name);
+		}
+	}
+	paths = malloc(sizeof(char*) * PATH_FILES);
+	for(i=0; i<PATH_FILES; i++) {
+		j = i % (PATH_FANOUT * PATH_FANOUT);
+		sprintf(name, "Some file number %d.dat", i);
+		vdf_add_file_virt(sub[j], name, 0, zero_cback, NULL, 0);
+		paths[i] = malloc(128);
+		sprintf(paths[i], "Top level directory %d/Second level directory %d/%s", j / PATH_FANOUT, j % PATH_FANOUT, name);
+	}
+
+	printf("paths: cost of resolving a three component path with vdf_find_path()\n");
+	printf("  %8s %14s\n", "paths", "ns/lookup");
+	for(c=0; sets[c] != 0; c++) {
+		srand(1);
+		t = now();
+		for(i=0; i<PATH_LOOKUPS; i++) {
+			if(vdf_find_path(vdf_drive_root(drv), paths[rand() % sets[c]], 0) == NULL) {
+				fprintf(stderr, "vdf_find_path failed\n");
+				exit(1);
+			}
+		}
+		t = (now() - t) * 1e9 / PATH_LOOKUPS;
+		printf("  %8d %14.1f\n", sets[c], t);
+	}
+	for(i=0; i<PATH_FILES; i++)
+		free(paths[i]);
+	free(paths);
+	vdf_drive_free(drv);
+}
+
+static double timed_lock(vdf_drive *drv) {
+	double t = now();
+	if(vdf_drive_lock(drv) == -1) {
+		perror("vdf_drive_lock");
+		exit(1);
+	}
+	t = (now() - t) * 1e3;
+	vdf_drive_unlock(drv);
+	return t;
+}
+
+/* locking a big drive again after a small change, which only redoes what changed */
+static void bench_recalc(void) {
+	static const int counts[] = { 100000, 1000000, 0 };
+	vdf_drive *drv;
+	vdf_file *dir, *fil;
+	char name[32];
+	int c;
+	double ms[3];
+
+	printf("recalc: cost of locking a drive again after a change\n");
+	printf("  %8s %14s %14s %14s\n", "files", "add file ms", "set date ms", "resize ms");
+	for(c=0; counts[c] != 0; c++) {
+		drv = make_drive(counts[c]);
+		vdf_drive_unlock(drv);
+		sprintf(name, "D%06d", (counts[c] - 1) / FILES_PER_DIR);
+		dir = vdf_find_file(vdf_drive_root(drv), name, 0);
+		fil = vdf_add_file_virt(dir, "NEWFILE", 1, zero_cback, NULL, 0);
+		ms[0] = timed_lock(drv);
+		vdf_set_file_date(fil, 0);
+		ms[1] = timed_lock(drv);
+		vdf_set_file_size(fil, 100000);
+		ms[2] = timed_lock(drv);
+		vdf_drive_free(drv);
+		printf("  %8d %14.2f %14.2f %14.2f\n", counts[c], ms[0], ms[1], ms[2]);
+	}
+}
+
+static void bench_arena(void) {
+	static const int counts[] = { 100000, 1000000, 0 };
+	vdf_drive *drv;
+	vdf_drive_footprint fp;
+	int c;
+	double t;
+
+	printf("arena: memory held by a drive and the cost of freeing it\n");
+	printf("  %8s %12s %12s %12s %12s %12s\n", "files", "nodes MB", "strings MB", "dirs MB", "total MB", "free ms");
+	for(c=0; counts[c] != 0; c++) {
+		drv = make_drive(counts[c]);
+		vdf_get_drive_footprint(drv, &fp);
+		vdf_drive_unlock(drv);
+		t = now();
+		vdf_drive_free(drv);
+		t = now() - t;
+		printf("  %8d %12.1f %12.1f %12.1f %12.1f %12.2f\n", counts[c], fp.nodes / 1048576.0,
+			fp.strings / 1048576.0, fp.dirs / 1048576.0, fp.total / 1048576.0, t * 1000);
+	}
+}
+
+/* what an application does without vdf_import_tree() */
+static void import_serial(vdf_file *parent, const char *path) {
+	struct dirent *de;
+	struct stat st;
+	char sub[1024];
+	vdf_file *dir;
+	DIR *d;
+
+	d = opendir(path);
+	if(d == NULL)
+		return;
+	while((de = readdir(d)) != NULL) {
+		if(de->d_name[0] == '.')
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+		if(stat(sub, &st) == -1)
+			continue;
+		if(S_ISDIR(st.st_mode)) {
+			dir = vdf_add_dir(parent, de->d_name);
+			if(dir != NULL)
+				import_serial(dir, sub);
+		} else {
+			vdf_add_file_real(parent, de->d_name, sub, 0);
+		}
+	}
+	closedir(d);
+}
+
+static void bench_import(void) {
+	char path[] = "/tmp/vdf_benchXXXXXX", name[1024];
+	vdf_import_opts opts;
+	vdf_drive *drv;
+	FILE *f;
+	double t;
+	int i, j, m;
+
+	if(mkdtemp(path) == NULL) {
+		perror("mkdtemp");
+		return;
+	}
+	for(i=0; i<IMPORT_DIRS; i++) {
+		sprintf(name, "%s/Directory %03d", path, i);
+		mkdir(name, 0755);
+		for(j=0; j<IMPORT_FILES; j++) {
+			sprintf(name, "%s/Directory %03d/Picture %04d.jpeg", path, i, j);
+			f = fopen(name, "wb");
+			if(f != NULL) {
+				fputc(j, f);
+				fclose(f);
+			}
+		}
+	}
+
+	printf("import: adding a host tree of %d directories of %d files\n", IMPORT_DIRS, IMPORT_FILES);
+	printf("  %12s %14s\n", "walk", "ms");
+	for(m=0; m<3; m++) {
+		drv = vdf_drive_create(1ULL << 30, VDF_FAT32 | VDF_VFAT);
+		t = now();
+		if(m == 0) {
+			import_serial(vdf_drive_root(drv), path);
+		} else {
+			memset(&opts, 0, sizeof(opts));
+			opts.threads = (m == 1) ? 1 : 0;
+			vdf_import_tree(vdf_drive_root(drv), path, &opts);
+		}
+		t = now() - t;
+		printf("  %12s %14.1f\n", (m == 0) ? "serial" : (m == 1) ? "1 thread" : "per CPU", t * 1000);
+		vdf_drive_free(drv);
+	}
+
+	for(i=0; i<IMPORT_DIRS; i++) {
+		for(j=0; j<IMPORT_FILES; j++) {
+			sprintf(name, "%s/Directory %03d/Picture %04d.jpeg", path, i, j);
+			unlink(name);
+		}
+		sprintf(name, "%s/Directory %03d", path, i);
+		rmdir(name);
+	}
+	rmdir(path);
+}
+
+static void bench_autosize(void) {
+	vdf_drive *drv;
+	vdf_file *dir = NULL;
+	char name[32];
+	double t;
+	int i, m;
+
+	printf("autosize: %d files of %d KiB on a drive of a guessed size and one sized for them\n", AUTOSIZE_FILES, AUTOSIZE_FILESIZE / 1024);
+	printf("  %12s %12s %12s %12s %12s\n", "drive", "size GB", "cluster KB", "FAT MB", "lock ms");
+	for(m=0; m<2; m++) {
+		if(m == 0)
+			drv = vdf_drive_create(64ULL * 1024 * 1024 * 1024, VDF_FAT32);
+		else
+			drv = vdf_drive_create(256ULL * 1024 * 1024, VDF_FAT32 | VDF_AUTO_SIZE);
+		if(drv == NULL) {
+			perror("vdf_drive_create");
+			return;
+		}
+		for(i=0; i<AUTOSIZE_FILES; i++) {
+			if((i % FILES_PER_DIR) == 0) {
+				sprintf(name, "D%06d", i / FILES_PER_DIR);
+				dir = vdf_add_dir(vdf_drive_root(drv), name);
+			}
+			sprintf(name, "F%06d", i);
+			vdf_add_file_virt(dir, name, AUTOSIZE_FILESIZE, zero_cback, NULL, 0);
+		}
+		t = now();
+		if(vdf_drive_lock(drv) == -1) {
+			perror("vdf_drive_lock");
+			vdf_drive_free(drv);
+			return;
+		}
+		t = now() - t;
+		printf("  %12s %12.2f %12.1f %12.1f %12.1f\n", (m == 0) ? "guessed" : "auto",
+			vdf_drive_bytes(drv) / 1073741824.0, vdf_drive_clustersize(drv) / 1024.0,
+			vdf_drive_dataclusters(drv) * 4 / 1048576.0, t * 1000);
+		vdf_drive_free(drv);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} benchmarks[] = {
+	{ "lookup",		bench_lookup },
+	{ "sequential",	bench_sequential },
+	{ "realfile",	bench_realfile },
+	{ "meta",		bench_meta },
+	{ "smallfiles",	bench_smallfiles },
+	{ "async",		bench_async },
+	{ "fatgen",		bench_fatgen },
+	{ "sparse",		bench_sparse },
+	{ "bigdir",		bench_bigdir },
+	{ "populate",	bench_populate },
+	{ "tails",		bench_tails },
+	{ "paths",		bench_paths },
+	{ "recalc",		bench_recalc },
+	{ "arena",		bench_arena },
+	{ "import",		bench_import },
+	{ "autosize",	bench_autosize },
+	{ NULL,			NULL }
+};
+
+int main(int argc, char **argv) {
+	int i, j;
+
+	for(i=0; benchmarks[i].name != NULL; i++) {
+		if(argc > 1) {
+			for(j=1; j<argc; j++) {
+				if(!strcmp(argv[j], benchmarks[i].name))
+					break;
+			}
+			if(j == argc)
+				continue;
+		}
+		benchmarks[i].func();
+	}
+	return 0;
+}
@@ -74,14 +74,40 @@ typedef int32_t		sfilesz_t;
 typedef struct _vdf_drive vdf_drive;
 typedef struct _vdf_file vdf_file;
 typedef struct _vdf_transport vdf_transport;
+typedef struct _vdf_read_ctx vdf_read_ctx;
 
 typedef enum _vdf_file_cmd {
 	vfc_read,
-	vfc_write
+	vfc_write,
+	vfc_readahead				/* hint that 'len' bytes at 'off' will be read soon. 'buf' is NULL. only sent to files added with VAF_READAHEAD */
 } vdf_file_cmd;
 
 typedef int (*vdf_file_callback)(vdf_file_cmd cmd, vdf_file *file, fileoff_t off, filesz_t len, void *buf, void *param);
 
+/* A range of a virtual file added with vdf_add_file_async() to be copied to 'buf' */
+typedef struct _vdf_file_range {
+	fileoff_t		off;
+	filesz_t		len;
+	void			*buf;
+} vdf_file_range;
+
+/* A request for data from a virtual file added with vdf_add_file_async(). The provider fills
+   every range, from any thread, and then calls complete() with 0 or an errno value. The
+   request and its buffers must not be touched once complete() has been called. */
+typedef struct _vdf_file_request vdf_file_request;
+struct _vdf_file_request {
+	uint32_t		id;							/* unique for the drive */
+	vdf_file		*file;
+	int				cnt;						/* number of ranges */
+	vdf_file_range	*ranges;
+	void			(*complete)(vdf_file_request *req, int err);
+	void			*priv;						/* used by libvdf */
+};
+
+/* Returns 0 once the request has been taken (complete() may already have been called)
+   or -1 with errno set to fail it */
+typedef int (*vdf_file_async_callback)(vdf_file_request *req, void *param);
+
 /* Extended parameters for vdf_createdrive_ext() */
 typedef struct _vcd_driveext {
 	int			flags;
@@ -95,6 +121,15 @@ typedef struct _vcd_driveext {
 #define VDE_AUTO_SPC		0x02
 #define VDE_AUTO_ROOTENT	0x04
 
+/* Memory held by a drive, in bytes, see vdf_get_drive_footprint() */
+typedef struct _vdf_drive_footprint {
+	size_t		nodes;			/* file and directory nodes, including released ones kept for reuse */
+	size_t		strings;		/* long names and real file paths */
+	size_t		dirs;			/* directory indexes, name tables and encoded directories */
+	size_t		layout;			/* ranges, range index and zero map */
+	size_t		total;			/* all of the above and the drive itself */
+} vdf_drive_footprint;
+
 /* Flags for vdf_createdrive() and related */
 #define VDF_VFAT			0x0100		/* use long file names */
 #define VDF_MBR				0x0200		/* disk has MBR with single partition */
@@ -105,11 +140,37 @@ typedef struct _vcd_driveext {
 #define VDF_CLUSTERLIST		0x2000		/* store a full list of clusters. can use more memory for large drives */
 #define VDF_ENABLE_WRITE	0x2000		/* enable writing. implies VDF_CLUSTERLIST */
 #endif
+#define VDF_MMAP			0x4000		/* map all real files into memory while the drive is locked (see VAF_MMAP) */
+#define VDF_SINGLE_FAT		0x8000		/* only one copy of the FAT. saves space, but not every OS will mount it */
+#define VDF_DIR_BLOBS		0x40000		/* encode every directory when the drive is recalculated, so reading one is a copy.
+										   uses as much memory as the directories take up on the drive */
+#define VDF_AUTO_SIZE		0x100000	/* size the drive for its contents when it is locked, leaving the size given free. it is sized again
+										   once they outgrow it or shrink to under half of it. picks the FAT type and cluster size unless given */
 #define VDF_FAT_AUTO		0x00		/* choose FAT type automatically based on size */
 #define VDF_FAT_AUTO_NO32	0x10		/* choose FAT12 or FAT16 automatically, based on size */
 #define VDF_FAT_SAME		0x20		/* keep current (possibly automatically chosen) FAT type. for use with vdf_recreate() and vdf_recreate_ext() */
 #define VDF_FS_MASK			0xff
 
+/* Flags for vdf_add_file_real() and vdf_add_file_virt(). vdf_add_file_async() takes none of them
+   (its providers get no vfc_readahead hints) and fails with EINVAL if any are given */
+#define VAF_MMAP			0x01		/* real: map the file into memory while the drive is locked. the file must not be truncated until the drive is unlocked */
+#define VAF_READAHEAD		0x02		/* virtual: send vfc_readahead hints to the callback when the file is being read sequentially */
+
+/* Options for vdf_import_tree(). The counts are filled in when it returns */
+typedef struct _vdf_import_opts {
+	int			flags;			/* VIF_* */
+	int			add_flags;		/* VAF_* flags for the files added */
+	int			threads;		/* threads reading the host tree, 0 for one per CPU */
+	const char	**include;		/* only add files whose name matches one of these fnmatch() patterns. NULL terminated, NULL for all */
+	const char	**exclude;		/* leave out files and directories whose name matches one of these. NULL terminated or NULL */
+	int			files;			/* files added */
+	int			dirs;			/* directories added */
+	int			skipped;		/* entries left out as FAT can't hold their name or size, the name is already taken or they can't be read */
+} vdf_import_opts;
+
+/* Flags for vdf_import_opts.flags */
+#define VIF_FOLLOW			0x01		/* follow symbolic links (otherwise they are left out) */
+
 /* Filesystem IDs. Also used as flags for vdf_createdrive() and related */
 #define VDF_FAT12			0x01
 #define VDF_FAT16			0x02
@@ -204,12 +265,22 @@ extern LIBFUNC ssize_t vdf_get_drive_label(vdf_drive *drv, char *label, size_t l
 extern LIBFUNC int vdf_set_drive_label(vdf_drive *drv, const char *label);
 extern LIBFUNC int vdf_set_drive_serial(vdf_drive *drv, uint32_t serial);
 extern LIBFUNC int32_t vdf_get_drive_serial(vdf_drive *drv);
+extern LIBFUNC int vdf_set_drive_fd_cache(vdf_drive *drv, int max_fds);
+extern LIBFUNC int vdf_get_drive_fd_cache(vdf_drive *drv);
+extern LIBFUNC int vdf_set_drive_readahead(vdf_drive *drv, size_t max_bytes);
+extern LIBFUNC ssize_t vdf_get_drive_readahead(vdf_drive *drv);
+extern LIBFUNC int vdf_set_drive_meta_cache(vdf_drive *drv, size_t max_bytes);
+extern LIBFUNC ssize_t vdf_get_drive_meta_cache(vdf_drive *drv);
+extern LIBFUNC int vdf_get_drive_meta_cache_stats(vdf_drive *drv, uint64_t *hits, uint64_t *misses);
+extern LIBFUNC int vdf_get_drive_footprint(vdf_drive *drv, vdf_drive_footprint *fp);
 
 extern LIBFUNC vdf_file *vdf_drive_root(vdf_drive *drv);
 
 extern LIBFUNC vdf_file *vdf_add_dir(vdf_file *parent, const char *name);
 extern LIBFUNC vdf_file *vdf_add_file_real(vdf_file *parent, const char *name, const char *path, int flags);
 extern LIBFUNC vdf_file *vdf_add_file_virt(vdf_file *parent, const char *name, size_t len, vdf_file_callback cback, void *param, int flags);
+extern LIBFUNC vdf_file *vdf_add_file_async(vdf_file *parent, const char *name, size_t len, vdf_file_async_callback cback, void *param, int flags);
+extern LIBFUNC int vdf_import_tree(vdf_file *parent, const char *path, vdf_import_opts *opts);
 
 extern LIBFUNC int vdf_delete_file(vdf_file *file);
 extern LIBFUNC int vdf_move_file(vdf_file *file, vdf_file *new_parent);
@@ -258,6 +329,10 @@ extern LIBFUNC int vdf_drive_is_locked(vdf_drive *drv);
 extern LIBFUNC int vdf_read_sector(vdf_drive *drv, sector_t sector, void *buffer);
 extern LIBFUNC int vdf_read_sectors(vdf_drive *drv, sector_t sector, sectcnt_t cnt, void *buffer);
 extern LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt, void *buffer);
+extern LIBFUNC vdf_read_ctx *vdf_read_ctx_create(vdf_drive *drv);
+extern LIBFUNC int vdf_read_ctx_free(vdf_read_ctx *ctx);
+extern LIBFUNC int vdf_read_sectors_ctx(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, void *buffer);
+extern LIBFUNC sdrivesz_t vdf_read_bytes_ctx(vdf_read_ctx *ctx, driveoff_t off, drivesz_t cnt, void *buffer);
 extern LIBFUNC int vdf_dump_drive(vdf_drive *drv, const char *path);
 extern LIBFUNC int vdf_dump_drive_info(vdf_drive *drv, FILE *f);
 
@@ -0,0 +1,213 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+#include "vdf_arena.h"
+
+/*
+	File nodes and the strings hanging off them (long names and real file paths) are
+	carved out of large chunks owned by the drive, instead of a malloc() each. A drive with
+	millions of entries then takes a few hundred allocations rather than millions, and
+	freeing the drive hands the chunks back without visiting any file.
+
+	Nodes given back (by vdf_delete_file() and friends) go on a free list chained through
+	'parent' and are reused first. They keep VFF_DELETED, so a stale handle still fails
+	file_is_valid() until the node is reused. Strings are rounded up to a multiple of
+	ARENA_STR_ALIGN and given back to a free list per size, which suits names well since a
+	rename is usually about the same length. Anything longer than ARENA_STR_MAX, which is
+	only ever a real file path, gets a chunk of its own that is freed as soon as the string
+	is.
+*/
+
+#define NODE_CHUNK_MIN		64					/* nodes in the first chunk, doubling up to NODE_CHUNK_MAX */
+#define NODE_CHUNK_MAX		16384
+#define STR_CHUNK_MIN		4096				/* bytes in the first string chunk, doubling up to STR_CHUNK_MAX */
+#define STR_CHUNK_MAX		(1024 * 1024)
+
+/* chunk data starts after the header, rounded up so that anything can be stored there */
+#define CHUNK_HDR			((sizeof(vdf_chunk) + 15) & ~(size_t)15)
+
+static vdf_chunk *chunk_new(list_head *head, size_t size) {
+	vdf_chunk *c = malloc(size);
+	if(c == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	c->size = size;
+	list_add(&c->list, head);
+	return c;
+}
+
+/* size of the next chunk for a list, double the last one up to 'max' */
+static size_t chunk_grow(list_head *head, size_t min, size_t max) {
+	size_t size;
+	if(list_empty(head))
+		return min;
+	size = (list_item(head->next, vdf_chunk, list)->size - CHUNK_HDR) * 2;
+	return (size > max) ? max : size;
+}
+
+static void chunks_free(list_head *head) {
+	vdf_chunk *c, *c_n;
+	list_foreach_item_safe(vdf_chunk, c, c_n, head, list) {
+		free(c);
+	}
+	INIT_LIST_HEAD(head);
+}
+
+void arena_init(vdf_drive *drv) {
+	INIT_LIST_HEAD(&drv->node_chunks);
+	INIT_LIST_HEAD(&drv->str_chunks);
+	INIT_LIST_HEAD(&drv->str_long);
+}
+
+void arena_free(vdf_drive *drv) {
+	chunks_free(&drv->node_chunks);
+	chunks_free(&drv->str_chunks);
+	chunks_free(&drv->str_long);
+	drv->node_free = NULL;
+	drv->node_pos = NULL;
+	drv->node_left = 0;
+	drv->str_pos = NULL;
+	drv->str_left = 0;
+	memset(drv->str_free, 0, sizeof(drv->str_free));
+	drv->node_bytes = 0;
+	drv->str_bytes = 0;
+}
+
+/* a zeroed node */
+vdf_file *arena_file_alloc(vdf_drive *drv) {
+	vdf_chunk *c;
+	vdf_file *fil;
+	size_t cnt;
+
+	if(drv->node_free != NULL) {
+		fil = drv->node_free;
+		drv->node_free = fil->parent;
+	} else {
+		if(drv->node_left == 0) {
+			cnt = chunk_grow(&drv->node_chunks, sizeof(vdf_file) * NODE_CHUNK_MIN, sizeof(vdf_file) * NODE_CHUNK_MAX) / sizeof(vdf_file);
+			c = chunk_new(&drv->node_chunks, CHUNK_HDR + (sizeof(vdf_file) * cnt));
+			if(c == NULL)
+				return NULL;
+			drv->node_bytes += c->size;
+			drv->node_pos = (vdf_file*)((char*)c + CHUNK_HDR);
+			drv->node_left = (int)cnt;
+		}
+		fil = drv->node_pos++;
+		drv->node_left--;
+	}
+	memset(fil, 0, sizeof(vdf_file));
+	return fil;
+}
+
+void arena_file_release(vdf_drive *drv, vdf_file *file) {
+	file->flags = VFF_DELETED;
+	file->parent = drv->node_free;
+	drv->node_free = file;
+}
+
+char *arena_strdup(vdf_drive *drv, const char *s) {
+	size_t len = strlen(s) + 1, size;
+	vdf_chunk *c;
+	char *p;
+	int cls;
+
+	if(len > ARENA_STR_MAX) {
+		c = chunk_new(&drv->str_long, CHUNK_HDR + len);
+		if(c == NULL)
+			return NULL;
+		drv->str_bytes += c->size;
+		p = (char*)c + CHUNK_HDR;
+		memcpy(p, s, len);
+		return p;
+	}
+	cls = (int)((len - 1) / ARENA_STR_ALIGN);
+	size = (size_t)(cls + 1) * ARENA_STR_ALIGN;
+	if(drv->str_free[cls] != NULL) {
+		p = drv->str_free[cls];
+		drv->str_free[cls] = *(char**)p;
+	} else {
+		if(drv->str_left < size) {
+			/* the rest of the old chunk is too small to bother with */
+			size = chunk_grow(&drv->str_chunks, STR_CHUNK_MIN, STR_CHUNK_MAX);
+			c = chunk_new(&drv->str_chunks, CHUNK_HDR + size);
+			if(c == NULL)
+				return NULL;
+			drv->str_bytes += c->size;
+			drv->str_pos = (char*)c + CHUNK_HDR;
+			drv->str_left = size;
+			size = (size_t)(cls + 1) * ARENA_STR_ALIGN;
+		}
+		p = drv->str_pos;
+		drv->str_pos += size;
+		drv->str_left -= size;
+	}
+	memcpy(p, s, len);
+	return p;
+}
+
+void arena_strfree(vdf_drive *drv, char *s) {
+	size_t len = strlen(s) + 1;
+	vdf_chunk *c;
+	int cls;
+
+	if(len > ARENA_STR_MAX) {
+		c = (vdf_chunk*)(s - CHUNK_HDR);
+		drv->str_bytes -= c->size;
+		list_del(&c->list);
+		free(c);
+		return;
+	}
+	cls = (int)((len - 1) / ARENA_STR_ALIGN);
+	*(char**)s = drv->str_free[cls];
+	drv->str_free[cls] = s;
+}
+
+LIBFUNC int vdf_get_drive_footprint(vdf_drive *drv, vdf_drive_footprint *fp) {
+	vdf_file *dir;
+	size_t n;
+
+	if(!drive_is_valid(drv) || (fp == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+	fp->nodes = drv->node_bytes;
+	fp->strings = drv->str_bytes;
+	fp->dirs = 0;
+	list_foreach_item(vdf_file, dir, &drv->all_dirs, dir.alldirs) {
+		fp->dirs += dir_footprint(dir);
+	}
+	n = sizeof(vdf_filerange) * drv->range_size;
+	n += (sizeof(sector_t) + sizeof(cluster_t) + sizeof(int)) * drv->index.size;
+	n += sizeof(vdf_zerospan) * drv->zero_size;
+	fp->layout = n;
+	fp->total = sizeof(vdf_drive) + fp->nodes + fp->strings + fp->dirs + fp->layout;
+	return 0;
+}
@@ -173,7 +173,7 @@ int read_sector_boot(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *b
 			boot->sectors_per_fat = le_16(drv->fat_sectors);
 		}
 		boot->sectors_per_track = le_16(1);
-		boot->fat_cnt = 2;
+		boot->fat_cnt = drv->fat_cnt;
 		boot->media_type = 0xf8;
 		boot->sectors_per_track = le_16(1);
 		boot->head_cnt = le_16(1);
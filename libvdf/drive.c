@@ -23,12 +23,18 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <vdf.h>
 #include "vdf_drive.h"
 #include "vdf_file.h"
 #include "vdf_transport.h"
+#include "vdf_fdcache.h"
+#include "vdf_metacache.h"
+#include "vdf_mmap.h"
+#include "vdf_pathcache.h"
+#include "vdf_read.h"
 
 typedef struct _cluster_size_range {
 	drivesz_t max_size;
@@ -60,6 +66,22 @@ static cluster_size_range fat32_cluster_ranges[] = {
 	{ 0,			KiB(32) }
 };
 
+typedef struct _vdf_geometry {
+	int filesys;
+	size_t bps;
+	int spc;
+	size_t bpc;
+	sectcnt_t sectors;
+	clustcnt_t clusters;
+	int root_dir_cnt;
+	int dirent_per_sector;
+	sectcnt_t fat_sectors;
+	sector_t fat1_start;
+	int fat_cnt;
+	sectcnt_t root_sectors;
+	sector_t data_start;
+} vdf_geometry;
+
 static vcd_driveext driveext_auto = { VDE_AUTO_BPS | VDE_AUTO_SPC | VDE_AUTO_ROOTENT, -1, -1 };
 
 static vdf_drive *createdrive_ext(vdf_drive *drv, drivesz_t size, int flags, vcd_driveext *ext);
@@ -127,39 +149,61 @@ LIBFUNC vdf_drive *vdf_drive_recreate_extsame(vdf_drive *drv, uint64_t size, int
 	return vdf_drive_recreate_ext(drv, size, flags, &ext);
 }
 
-static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_driveext *ext) {
+/* the parameters that don't depend on the size */
+static int geometry_check(int flags, vcd_driveext *ext) {
+	switch(flags & VDF_FS_MASK) {
+		case VDF_FAT_AUTO: case VDF_FAT_AUTO_NO32:
+		case VDF_FAT12: case VDF_FAT16: case VDF_FAT32:
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	if(!(ext->flags & VDE_AUTO_BPS)) {
+		switch(ext->bytes_per_sector) {
+			case 512: case 1024: case 2048: case 4096:
+				break;
+			default:
+				errno = EINVAL;
+				return -1;
+		}
+	}
+	if(!(ext->flags & VDE_AUTO_SPC)) {
+		switch(ext->sectors_per_cluster) {
+			case 1: case 2: case 4: case 8: case 16: case 32: case 64: case 128:
+				break;
+			default:
+				errno = EINVAL;
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* work out the layout of a drive of 'size' bytes, without touching any drive */
+static int drive_geometry(vdf_geometry *g, uint64_t size, int flags, vcd_driveext *ext) {
 	size_t bps, bpc;
 	sectcnt_t sectors;
 	clustcnt_t clusters;
-	int isnew = 0, spc;
-	int fsys_flag, fsys = -1, orig_fsys, root_dir_cnt;
+	int spc;
+	int fsys_flag, fsys = -1, root_dir_cnt;
 	sectcnt_t fat_sectors, root_sectors;
 	sector_t data_start, fat1_start;
-	int dirent_per_sector;
+	int dirent_per_sector, fat_cnt;
 
+	if(geometry_check(flags, ext) == -1)
+		return -1;
 	fsys_flag = flags & VDF_FS_MASK;
-#ifdef ENABLE_CLUSTER_LIST
-	if(flags & VDF_ENABLE_WRITE)
-		flags |= VDF_CLUSTERLIST;
-#endif
 
 	if(ext->flags & VDE_AUTO_ROOTENT)
 		root_dir_cnt = 512;
 	else
 		root_dir_cnt = ext->root_dir_cnt;
 
-	if(ext->flags & VDE_AUTO_BPS) {
+	if(ext->flags & VDE_AUTO_BPS)
 		bps = 512;
-	} else {
-		switch(ext->bytes_per_sector) {
-			case 512: case 1024: case 2048: case 4096:
-				break;
-			default:
-				errno = EINVAL;
-				return NULL;
-		}
+	else
 		bps = ext->bytes_per_sector;
-	}
 	size += bps - 1;
 	size &= ~(uint64_t)(bps - 1);
 	sectors = (size_t)(size / bps);
@@ -173,16 +217,9 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 				fsys = VDF_FAT16;
 			} else {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 		} else {
-			switch(fsys_flag) {
-				case VDF_FAT12: case VDF_FAT16: case VDF_FAT32:
-					break;
-				default:
-					errno = EINVAL;
-					return NULL;
-			}
 			fsys = fsys_flag;
 		}
 		switch(fsys) {
@@ -195,17 +232,13 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 			case VDF_FAT32:
 				spc = find_spc(fat32_cluster_ranges, size, bps);
 				break;
+			default:
+				errno = EINVAL;
+				return -1;
 		}
 		bpc = bps * spc;
 	} else {
 		spc = ext->sectors_per_cluster;
-		switch(spc) {
-			case 1: case 2: case 4: case 8: case 16: case 32: case 64: case 128:
-				break;
-			default:
-				errno = EINVAL;
-				return NULL;
-		}
 		bpc = bps * spc;
 		clusters = (size_t)(size / bpc);
 		switch(fsys_flag) {
@@ -231,6 +264,7 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 		}
 	}
 	dirent_per_sector = bps / 32;
+	fat_cnt = (flags & VDF_SINGLE_FAT) ? 1 : 2;
 	switch(fsys) {
 		case VDF_FAT12:
 			if(flags & VDF_ALIGN_CLUSTER)
@@ -253,16 +287,16 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 				fat_sectors += spc - 1;
 				fat_sectors &= ~(spc - 1);
 			}
-			data_start += fat_sectors * 2;
+			data_start += fat_sectors * fat_cnt;
 			clusters = (sectors - data_start) / spc;
 			if(clusters > 4084) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 #if 0
 			if(clusters > (0xfef - 2)) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 #endif
 			break;
@@ -287,24 +321,24 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 				fat_sectors += spc - 1;
 				fat_sectors &= ~(spc - 1);
 			}
-			data_start += fat_sectors * 2;
+			data_start += fat_sectors * fat_cnt;
 			clusters = (sectors - data_start) / spc;
 			if((flags & VDF_FAIL_WARN) && (clusters < 4085)) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 			if(clusters < 4085) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 			if(clusters > 65524) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 #if 0
 			if(clusters > (0xffef - 2)) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 #endif
 			break;
@@ -324,22 +358,131 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 				fat_sectors += spc - 1;
 				fat_sectors &= ~(spc - 1);
 			}
-			data_start += fat_sectors * 2;
+			data_start += fat_sectors * fat_cnt;
 			clusters = (sectors - data_start) / spc;
 			if((flags & VDF_FAIL_WARN) && (clusters <= 65525)) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 			if(clusters < 65525) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
 			}
 			if(clusters > (0xfffffef - 2)) {
 				errno = EINVAL;
-				return NULL;
+				return -1;
+			}
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	/* too small to hold anything */
+	if(data_start >= sectors) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	g->filesys = fsys;
+	g->bps = bps;
+	g->spc = spc;
+	g->bpc = bpc;
+	g->sectors = sectors;
+	g->clusters = clusters;
+	g->root_dir_cnt = root_dir_cnt;
+	g->dirent_per_sector = dirent_per_sector;
+	g->fat_sectors = fat_sectors;
+	g->fat1_start = fat1_start;
+	g->fat_cnt = fat_cnt;
+	g->root_sectors = root_sectors;
+	g->data_start = data_start;
+	return 0;
+}
+
+/*
+	With VDF_AUTO_SIZE the drive is made just big enough for what is on it, plus
+	drv->headroom bytes. A file's clusters depend on the cluster size, which depends on the
+	size of the drive, so the clusters needed are counted for every cluster size there can
+	be in one pass over the files, and the search for the size runs on those counts.
+*/
+#define AUTOSIZE_SHIFT_MIN	9					/* smallest cluster, 512 bytes */
+#define AUTOSIZE_SHIFTS		11					/* up to 512KiB clusters */
+#define AUTOSIZE_TRIES		128
+#define AUTOSIZE_BPC(i)		((size_t)1 << ((i) + AUTOSIZE_SHIFT_MIN))
+
+/* clusters needed by the files for each cluster size, not counting the root directory */
+static void drive_content(vdf_drive *drv, clustcnt_t *need) {
+	vdf_file *fil;
+	int i;
+
+	memset(need, 0, sizeof(clustcnt_t) * AUTOSIZE_SHIFTS);
+	if(drv == NULL)
+		return;
+	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
+		if((fil->size == 0) || (fil == drv->root_dir))
+			continue;
+		for(i=0; i<AUTOSIZE_SHIFTS; i++)
+			need[i] += (fil->size + AUTOSIZE_BPC(i) - 1) >> (i + AUTOSIZE_SHIFT_MIN);
+	}
+}
+
+/* smallest geometry holding the files of 'drv' (NULL for none) and 'headroom' bytes */
+static int autosize_geometry(vdf_geometry *g, vdf_drive *drv, drivesz_t headroom, int flags, vcd_driveext *ext, uint64_t *sizep) {
+	clustcnt_t need[AUTOSIZE_SHIFTS], n, short_by;
+	uint64_t size;
+	int i, shift;
+
+	/* anything wrong with these would otherwise look like a drive that is too small */
+	if(geometry_check(flags, ext) == -1)
+		return -1;
+	drive_content(drv, need);
+	size = MiB(1);
+	for(i=0; i<AUTOSIZE_TRIES; i++) {
+		if(drive_geometry(g, size, flags, ext) == 0) {
+			for(shift=0; AUTOSIZE_BPC(shift) < g->bpc; shift++)
+				;
+			n = need[shift] + (clustcnt_t)((headroom + g->bpc - 1) / g->bpc);
+			if((drv != NULL) && (g->filesys == VDF_FAT32))
+				n += (drv->root_dir->size + g->bpc - 1) / g->bpc;
+			if(n < g->clusters) {
+				*sizep = size;
+				return 0;
 			}
+			/* grow by what is missing, and the FAT entries for it */
+			short_by = n - g->clusters + 1;
+			size += (uint64_t)short_by * g->bpc + ((uint64_t)short_by * 4 * g->fat_cnt);
+			size = (size + g->bps - 1) & ~(uint64_t)(g->bps - 1);
+		} else {
+			/* too few clusters for the filesystem asked for. too many can't be fixed by growing and
+			   ends in ENOSPC below */
+			size += size / 8;
+		}
+		if(size > TiB(4))
 			break;
 	}
+	errno = ENOSPC;
+	return -1;
+}
+
+static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_driveext *ext) {
+	vdf_geometry g;
+	drivesz_t headroom = 0;
+	int isnew = 0, orig_fsys;
+	size_t orig_bpc;
+	vdf_file *fil;
+
+#ifdef ENABLE_CLUSTER_LIST
+	if(flags & VDF_ENABLE_WRITE)
+		flags |= VDF_CLUSTERLIST;
+#endif
+	if(flags & VDF_AUTO_SIZE) {
+		headroom = size;
+		if(autosize_geometry(&g, drv, headroom, flags, ext, &size) == -1)
+			return NULL;
+	} else {
+		if(drive_geometry(&g, size, flags, ext) == -1)
+			return NULL;
+	}
 
 	if(drv == NULL) {
 		isnew = 1;
@@ -349,29 +492,34 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 			return NULL;
 		}
 		memset(drv, 0, sizeof(vdf_drive));
-	} else
+	} else {
 		orig_fsys = drv->filesys;
-	drv->flags = flags | VDF_DIRTY;
-	drv->filesys = fsys;
-	drv->bps = bps;
-	drv->spc = spc;
-	drv->bpc = bpc;
-	drv->sectors = sectors;
-	drv->clusters = clusters;
-	drv->root_dir_cnt = root_dir_cnt;
-	drv->dirent_per_sector = dirent_per_sector;
-	drv->fat_sectors = fat_sectors;
-	drv->fat1_start = fat1_start;
-	drv->fat2_start = fat1_start + fat_sectors;
-	drv->root_start = drv->fat2_start + fat_sectors;
-	drv->root_sectors = root_sectors;
-	drv->data_start = drv->data_end = data_start;
+		orig_bpc = drv->bpc;
+	}
+	drv->flags = flags | VDF_DIRTY | VDF_RECALC_ALL;
+	drv->headroom = headroom;
+	drv->ext = *ext;
+	drv->filesys = g.filesys;
+	drv->bps = g.bps;
+	drv->spc = g.spc;
+	drv->bpc = g.bpc;
+	drv->sectors = g.sectors;
+	drv->clusters = g.clusters;
+	drv->root_dir_cnt = g.root_dir_cnt;
+	drv->dirent_per_sector = g.dirent_per_sector;
+	drv->fat_sectors = g.fat_sectors;
+	drv->fat1_start = g.fat1_start;
+	drv->fat_cnt = g.fat_cnt;
+	drv->fat2_start = g.fat1_start + g.fat_sectors;
+	drv->root_start = g.fat1_start + g.fat_sectors * g.fat_cnt;
+	drv->root_sectors = g.root_sectors;
+	drv->data_start = drv->data_end = g.data_start;
 
 	if(flags & VDF_MBR) {
 		/* Note: this means that the size passed in by the user is the 'partition size' and the total device will
 		   have a different, and possibly slightly strange size. */
 		if(flags & VDF_MBR_PAD) {
-			drv->mbr_sectors = spc;		/* TODO: DOS pads out the MBR before the start of a partition
+			drv->mbr_sectors = g.spc;	/* TODO: DOS pads out the MBR before the start of a partition
 										   However, DOS pads to a multiple of sectors-per-track, which we don't know.
 										   So we'll use sectors-per-cluster for want of a more correct value */
 		} else {
@@ -386,24 +534,47 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 		drv->serial = DEFAULT_DRIVE_SERIAL;
 		INIT_LIST_HEAD(&drv->all_files);
 		INIT_LIST_HEAD(&drv->transports);
+		INIT_LIST_HEAD(&drv->dirty_dirs);
+		INIT_LIST_HEAD(&drv->all_dirs);
+		drv->relayout = INT_MAX;
+		fdcache_init(drv);
+		metacache_init(drv);
+		pathcache_init(drv);
+		arena_init(drv);
+		mutex_init(&drv->req_lock);
+		drv->ra_max = DEFAULT_READAHEAD;
 
 		drv->root_dir = create_root_dir(drv);
 		if(drv->root_dir == NULL) {
+			fdcache_free(drv);
+			metacache_free(drv);
+			pathcache_free(drv);
+			mutex_destroy(&drv->req_lock);
+			arena_free(drv);
 			free(drv);
 			return NULL;
 		}
 	} else {
 		if(orig_fsys == VDF_FAT32) {
-			if(fsys != VDF_FAT32) {
+			if(g.filesys != VDF_FAT32) {
 				list_del(&drv->root_dir->alllist);
 				drv->file_cnt--;
+				drv->root_dir->range_ind = -1;
 			}
 		} else {
-			if(fsys == VDF_FAT32) {
+			if(g.filesys == VDF_FAT32) {
 				list_add_tail(&drv->root_dir->alllist, &drv->all_files);
 				drv->file_cnt++;
 			}
 		}
+		/* the files were counted in clusters of the old size */
+		if(g.bpc != orig_bpc) {
+			list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
+				file_recalc_clusters(fil);
+			}
+			if(g.filesys != VDF_FAT32)
+				file_recalc_clusters(drv->root_dir);
+		}
 	}
 
 	return drv;
@@ -411,6 +582,7 @@ static vdf_drive *createdrive_ext(vdf_drive *drv, uint64_t size, int flags, vcd_
 
 LIBFUNC int vdf_drive_free(vdf_drive *drv) {
 	vdf_transport *trans, *trans_n;
+	vdf_file *dir;
 	if(!drive_is_valid(drv)) {
 		errno = EINVAL;
 		return -1;
@@ -418,11 +590,22 @@ LIBFUNC int vdf_drive_free(vdf_drive *drv) {
 	list_foreach_item_safe(vdf_transport, trans, trans_n, &drv->transports, drivelist) {
 		vdf_transport_close(trans);
 	}
-	delete_file(drv->root_dir);
+	/* the files themselves go with the arena, only what they hold outside it is freed */
+	list_foreach_item(vdf_file, dir, &drv->all_dirs, dir.alldirs) {
+		dir_free_tables(dir);
+	}
+	drive_unmap_files(drv);
+	fdcache_free(drv);
+	metacache_free(drv);
+	pathcache_free(drv);
+	mutex_destroy(&drv->req_lock);
 	if(drv->ranges != NULL)
 		free(drv->ranges);
+	range_index_free(&drv->index);
+	zeromap_free(drv);
 	if(drv->label != NULL)
 		free(drv->label);
+	arena_free(drv);
 	drv->flags |= VDF_DELETED;
 	free(drv);
 	return 0;
@@ -521,6 +704,7 @@ LIBFUNC int vdf_set_drive_label(vdf_drive *drv, const char *label) {
 		}
 	} else
 		drv->label = NULL;
+	dir_set_dirty(drv->root_dir, VFF_RECOUNT);
 	set_drive_dirty(drv);
 	return 0;
 }
@@ -560,6 +744,7 @@ LIBFUNC int vdf_set_drive_serial(vdf_drive *drv, uint32_t serial) {
 		return -1;
 	}
 	drv->serial = serial;
+	metacache_flush(drv);
 	return 0;
 }
 
@@ -587,6 +772,7 @@ LIBFUNC int vdf_drive_lock(vdf_drive *drv) {
 	if(drv->lockcnt == 0) {
 		if(vdf_drive_recalc(drv) == -1)
 			return -1;
+		drive_map_files(drv);
 	}
 	drv->lockcnt++;
 	return 0;
@@ -601,7 +787,10 @@ LIBFUNC int vdf_drive_unlock(vdf_drive *drv) {
 		errno = EINVAL;
 		return -1;
 	}
-	drv->lockcnt--;
+	if(--drv->lockcnt == 0) {
+		drive_unmap_files(drv);
+		fdcache_flush(drv);
+	}
 	return 0;
 }
 
@@ -613,13 +802,10 @@ LIBFUNC int vdf_drive_is_locked(vdf_drive *drv) {
 	return drv->lockcnt != 0;
 }
 
+/* the drive needs recalculating before it can be locked. the directories that changed are marked with dir_set_dirty() */
 void set_drive_dirty(vdf_drive *drv) {
-	if(drv->flags & VDF_DIRTY)
-		return;
-	if(drv->ranges != NULL) {
-		free(drv->ranges);
-		drv->ranges = NULL;
-	}
+	drv->epoch++;
+	metacache_flush(drv);
 	drv->flags |= VDF_DIRTY;
 }
 
@@ -631,13 +817,135 @@ LIBFUNC int vdf_drive_is_dirty(vdf_drive *drv) {
 	return !!(drv->flags & VDF_DIRTY);
 }
 
-static int cmp_filerange(const void *r1, const void *r2) {
-	return ((const vdf_filerange*)r1)->sectstart - ((const vdf_filerange*)r2)->sectstart;
+/* queue every directory and the whole layout, for a new drive or a new format */
+static void drive_dirty_all(vdf_drive *drv) {
+	vdf_file *fil;
+
+	if(drv->filesys != VDF_FAT32)
+		dir_set_dirty(drv->root_dir, VFF_RECOUNT);
+	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
+		if(fil->attr & VFA_DIR)
+			dir_set_dirty(fil, VFF_RECOUNT);
+	}
+	drv->relayout = 0;
 }
 
-LIBFUNC int vdf_drive_recalc(vdf_drive *drv) {
+/* how read_sector_data() reads the file. mapped files are switched to RDO_MEM by file_map() */
+static int range_type(vdf_file *fil) {
+	if(fil->attr & VFA_DIR)
+		return RDO_DIR;
+	if(fil->flags & VFF_ASYNC)
+		return RDO_ASYNC;
+	if(fil->flags & VFF_VIRT)
+		return RDO_VIRT;
+	return (fil->real.map != NULL) ? RDO_MEM : RDO_FILE;
+}
+
+/*
+	Lay the files out again from range drv->relayout on. Everything before it is where it
+	was, so the files that follow are appended after the last of those, which makes new
+	files (they are always at the end of all_files) cheap to add. The directories holding
+	any entry whose start cluster moved are queued to be encoded again.
+*/
+static int drive_layout(vdf_drive *drv) {
+	vdf_filerange *r;
 	vdf_file *fil;
+	cluster_t start;
 	int i;
+
+	if(drv->range_size < drv->file_cnt) {
+		r = realloc(drv->ranges, sizeof(vdf_filerange) * drv->file_cnt);
+		if(r == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		drv->ranges = r;
+		drv->range_size = drv->file_cnt;
+	}
+	i = (drv->relayout < drv->range_cnt) ? drv->relayout : drv->range_cnt;
+	if(i == 0) {
+		drv->data_end = drv->data_start;
+		drv->data_cluster_end = 2;
+		fil = list_item(drv->all_files.next, vdf_file, alllist);
+	} else {
+		r = drv->ranges + i - 1;
+		drv->data_end = r->sectend;
+		drv->data_cluster_end = r->fatend;
+		fil = list_item(r->file->alllist.next, vdf_file, alllist);
+	}
+	list_foreach_item_from(vdf_file, fil, &drv->all_files, alllist) {
+		start = fil->start;
+		if(file_recalc_offsize(fil) == -1)
+			return -1;
+		if(fil->start != start)
+			file_entry_changed(fil);
+		if(fil->size == 0) {
+			fil->range_ind = -1;
+			continue;
+		}
+		r = drv->ranges + i;
+		r->file = fil;
+		r->sectstart = fil->startsect;
+		r->sectend = fil->startsect + (fil->clusters * drv->spc);
+		r->sectdata = fil->startsect + (sectcnt_t)((fil->size + drv->bps - 1) / drv->bps);
+		r->fatstart = fil->start;
+		r->fatend = fil->end;
+		r->size = fil->size;
+		r->type = range_type(fil);
+		fil->range_ind = i++;
+	}
+	drv->range_cnt = i;
+	return 0;
+}
+
+/*
+	VDF_AUTO_SIZE: size the drive again for what is on it now. Everything is laid out and
+	every directory encoded again if that changes anything. Returns 1 if it did.
+*/
+static int drive_autosize(vdf_drive *drv) {
+	vdf_geometry g;
+	drivesz_t headroom = drv->headroom;
+	uint64_t size;
+	vdf_file *dir;
+
+	if(autosize_geometry(&g, drv, headroom, drv->flags, &drv->ext, &size) == -1)
+		return -1;
+	if((g.sectors == drv->sectors) && (g.bpc == drv->bpc) && (g.filesys == drv->filesys))
+		return 0;
+	if(createdrive_ext(drv, size, drv->flags & ~VDF_AUTO_SIZE, &drv->ext) == NULL)
+		return -1;
+	drv->flags |= VDF_AUTO_SIZE;
+	drv->headroom = headroom;
+	list_foreach_item(vdf_file, dir, &drv->all_dirs, dir.alldirs) {
+		dir_set_dirty(dir, VFF_REENCODE);
+	}
+	drv->relayout = 0;
+	set_drive_dirty(drv);
+	return 1;
+}
+
+/* VDF_AUTO_SIZE: more than twice as big as it would be made now */
+static int drive_oversized(vdf_drive *drv) {
+	clustcnt_t used = drv->data_cluster_end - 2;
+	used += (clustcnt_t)((drv->headroom + drv->bpc - 1) / drv->bpc);
+	return (drv->clusters / 2) > used;
+}
+
+/*
+	Only what changed since the last recalculation is redone: the directories on the dirty
+	list are counted and indexed again, the files are laid out again from the first one
+	whose clusters moved (usually just the new ones at the end) and only the directories
+	whose entries changed are encoded again. A new drive, or one that has been formatted
+	again, is done in full the same way. With VDF_AUTO_SIZE the drive is sized for its
+	contents before a full layout, and again if they outgrew it or shrank to well under
+	half of it.
+*/
+LIBFUNC int vdf_drive_recalc(vdf_drive *drv) {
+	vdf_read_ctx ctx;
+	vdf_file *dir, *dir_n;
+	sectcnt_t clusters;
+	filesz_t size;
+	int relaid, recounted, resized;
 	if(!drive_is_valid(drv)) {
 		errno = EINVAL;
 		return -1;
@@ -648,31 +956,69 @@ LIBFUNC int vdf_drive_recalc(vdf_drive *drv) {
 	}
 	if(!(drv->flags & VDF_DIRTY))
 		return 0;
-	drv->data_end = drv->data_start;
-	drv->nonempty_file_cnt = 0;
-	drv->data_cluster_end = 2;
-	if(dir_recalc(drv->root_dir) == -1)
-		return -1;
-	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
-		if(file_recalc_offsize(fil) == -1)
-			return -1;
+	if(drv->flags & VDF_RECALC_ALL)
+		drive_dirty_all(drv);
+
+	recounted = 0;
+	list_foreach_item(vdf_file, dir, &drv->dirty_dirs, dir.dirty) {
+		if(!(dir->flags & VFF_RECOUNT))
+			continue;
+		clusters = dir->clusters;
+		size = dir->size;
+		dir_recount(dir);
+		/* the root directory of FAT12/16 has a place of its own */
+		if(((dir->parent != NULL) || (drv->filesys == VDF_FAT32)) &&
+				((dir->clusters != clusters) || ((dir->size == 0) != (size == 0))))
+			file_relayout(dir);
+		if(dir_index_build(dir) == -1)
+			goto fail;
+		recounted = 1;
 	}
-	if(drv->ranges != NULL)
-		free(drv->ranges);
-	drv->ranges = malloc(sizeof(vdf_filerange) * drv->nonempty_file_cnt);
-	i = 0;
-	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
-		if(vdf_file_is_dir(fil) || (fil->size != 0)) {
-			drv->ranges[i].file = fil;
-			drv->ranges[i].sectstart = fil->startsect;
-			drv->ranges[i].sectend = fil->startsect + (fil->clusters * drv->spc);
-			drv->ranges[i].fatstart = fil->start;
-			drv->ranges[i].fatend = fil->end;
-			i++;
-		}
+
+	resized = 0;
+	if((drv->flags & (VDF_AUTO_SIZE | VDF_RECALC_ALL)) == (VDF_AUTO_SIZE | VDF_RECALC_ALL)) {
+		resized = drive_autosize(drv);
+		if(resized == -1)
+			goto fail;
+	}
+	relaid = (drv->relayout != INT_MAX) || (drv->next_seq != drv->recalc_seq);
+	if(relaid && (drive_layout(drv) == -1)) {
+		/* the files outgrew the drive */
+		if(!(drv->flags & VDF_AUTO_SIZE) || (errno != ENOSPC) || resized)
+			goto fail;
+		if((drive_autosize(drv) == -1) || (drive_layout(drv) == -1))
+			goto fail;
+	} else if(relaid && !resized && (drv->flags & VDF_AUTO_SIZE) && drive_oversized(drv)) {
+		if(((resized = drive_autosize(drv)) == -1) || (resized && (drive_layout(drv) == -1)))
+			goto fail;
+	}
+	/* a directory that grew or shrank within its clusters has kept its range */
+	list_foreach_item(vdf_file, dir, &drv->dirty_dirs, dir.dirty) {
+		if((dir->flags & VFF_RECOUNT) && (dir->range_ind != -1))
+			drv->ranges[dir->range_ind].sectdata = dir->startsect + (sectcnt_t)((dir->size + drv->bps - 1) / drv->bps);
+	}
+	drv->nonempty_file_cnt = drv->range_cnt;
+	if(relaid && (range_index_build(drv) == -1))
+		goto fail;
+	if((relaid || recounted) && (zeromap_build(drv) == -1))
+		goto fail;
+
+	read_ctx_init(&ctx, drv);
+	list_foreach_item(vdf_file, dir, &drv->dirty_dirs, dir.dirty) {
+		if((dir->flags & VFF_REENCODE) && (dir_blob_build(drv, &ctx, dir) == -1))
+			goto fail;
+	}
+	list_foreach_item_safe(vdf_file, dir, dir_n, &drv->dirty_dirs, dir.dirty) {
+		dir->flags &= ~(VFF_RECOUNT | VFF_REENCODE);
+		list_del(&dir->dir.dirty);
 	}
-	qsort(drv->ranges, drv->nonempty_file_cnt, sizeof(vdf_filerange), cmp_filerange);
-	drv->flags &= ~VDF_DIRTY;
+	drv->relayout = INT_MAX;
+	drv->recalc_seq = drv->next_seq;
+	drv->flags &= ~(VDF_DIRTY | VDF_RECALC_ALL);
 	return 0;
+fail:
+	/* whatever was done is half finished, so start again from scratch next time */
+	drv->flags |= VDF_RECALC_ALL;
+	return -1;
 }
 
@@ -47,6 +47,7 @@
 #endif
 
 extern LIBFUNC int vdf_dump_drive_info(vdf_drive *drv, FILE *oup) {
+	vdf_drive_footprint fp;
 	vdf_file *fil;
 	int i;
 
@@ -79,13 +80,19 @@ extern LIBFUNC int vdf_dump_drive_info(vdf_drive *drv, FILE *oup) {
 	fprintf(oup, "  Dir entries/sector:    %u\n", drv->dirent_per_sector);
 	fprintf(oup, "  Sectors per FAT:       %u\n", drv->fat_sectors);
 	fprintf(oup, "  FAT 1 start:           %u\n", drv->fat1_start);
-	fprintf(oup, "  FAT 2 start:           %u\n", drv->fat2_start);
+	if(drv->fat_cnt > 1)
+		fprintf(oup, "  FAT 2 start:           %u\n", drv->fat2_start);
+	else
+		fprintf(oup, "  FAT 2 start:           <single FAT>\n");
 	fprintf(oup, "  Root dir start sect:   %u\n", drv->root_start);
 	fprintf(oup, "  Root dir sectors:      %u\n", drv->root_sectors);
 	fprintf(oup, "  Data sector start:     %u\n", drv->data_start);
 	fprintf(oup, "  Data sector end:       %u\n", drv->data_end);
 	fprintf(oup, "  Data cluster end:      %u\n", drv->data_cluster_end);
 	fprintf(oup, "  Data clusters used:    %u\n", drv->data_cluster_end - 2);
+	vdf_get_drive_footprint(drv, &fp);
+	fprintf(oup, "  Memory used:           %lu (nodes %lu, strings %lu, dirs %lu, layout %lu)\n",
+		(unsigned long)fp.total, (unsigned long)fp.nodes, (unsigned long)fp.strings, (unsigned long)fp.dirs, (unsigned long)fp.layout);
 	fprintf(oup, "\nFiles:\n");
 	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
 		fprintf(oup, "  %s: '%s'\n", (fil->attr & VFA_DIR) ? "Dir " : "File", fil->name);
@@ -102,7 +109,7 @@ extern LIBFUNC int vdf_dump_drive_info(vdf_drive *drv, FILE *oup) {
 		fprintf(oup, "    File entry count: %u\n", fil->fent_cnt + 1);
 	}
 	fprintf(oup, "\nRanges:\n");
-	for(i=0; i<drv->nonempty_file_cnt; i++) {
+	for(i=0; i<drv->range_cnt; i++) {
 		fprintf(oup, "%3u: '%s'\n", i, drv->ranges[i].file->name);
 		fprintf(oup, "     Sector start:  %u\n", drv->ranges[i].sectstart);
 		fprintf(oup, "     Sector end:    %u\n", drv->ranges[i].sectend);
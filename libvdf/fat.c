@@ -29,221 +29,188 @@
 #include "vdf_drive.h"
 #include "vdf_file.h"
 #include "vdf_read.h"
+#include "vdf_fatgen.h"
 
-static INLINE vdf_file *find_file_fat_entry(vdf_drive *drv, cluster_t ent, int *range_index) {
-#if 1
-	int i;
-	vdf_filerange *range;
-	if(ent >= drv->data_cluster_end)
+/* the FAT is generated from the ranges alone, the files themselves are never looked at */
+static INLINE vdf_filerange *find_range_fat_entry(vdf_drive *drv, cluster_t ent, int *range_index) {
+	if(ent >= drv->data_cluster_end) {
+		*range_index = -1;
 		return NULL;
-	range = drv->ranges;
-	for(i=0; i<drv->file_cnt; i++, range++) {
-		if(ent < range->fatend) {
-			*range_index = i;
-			return range->file;
-		}
 	}
-	*range_index = -1;
-	return NULL;
-#else
-	/* TODO: get this working */
-	int low, high, mid;
-	if(ent >= drv->fatent_cnt)
+	*range_index = range_find_cluster_from(drv, ent, *range_index);
+	if(*range_index == -1)
 		return NULL;
-	low = 0;
-	high = drv->file_cnt;
-	while(low < high) {
-		mid = low + ((high - low) / 2);
-		if(drv->ranges[mid].fatend < ent)
-			low = mid + 1;
-		else
-			high = mid;
-	}
-	if((low < drv->file_cnt) && (drv->ranges[low].fatend < ent)) {
-		*range_index = low;
-		return drv->ranges[low].file;
-	}
-	*range_index = -1;
-	return NULL;
-#endif
+	return drv->ranges + *range_index;
 }
 
-static INLINE vdf_file *fat_next_file(vdf_drive *drv, cluster_t ent, vdf_file *file, int *range_ind) {
-#if 0
-	file = find_file_fat_entry(drv, ent, range_ind);
-#elif 0
-	if(file->alllist.next == &drv->all_files)
-		file = NULL;
-	else
-		file = list_item(file->alllist.next, vdf_file, alllist);
-#else
+static INLINE vdf_filerange *fat_next_range(vdf_drive *drv, int *range_ind) {
 	(*range_ind)++;
-	if(*range_ind == drv->file_cnt)
-		file = NULL;
-	else
-		file = drv->ranges[*range_ind].file;
-#endif
-	return file;
+	if(*range_ind == drv->range_cnt)
+		return NULL;
+	return drv->ranges + *range_ind;
 }
 
 
-int read_sector_fat(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer) {
-	cluster_t ent, clust;
-	int halfent;
+/* value of FAT12 entry '*ent', moving on to the next entry and range */
+static INLINE cluster_t fat12_next_entry(vdf_drive *drv, cluster_t *ent, vdf_filerange **rng, int *range_ind) {
+	cluster_t e = (*ent)++;
+
+	if(e < 2) {
+		if(e == 1)
+			*rng = find_range_fat_entry(drv, 2, range_ind);
+		return e == 0 ? 0xff8 : 0xfff;
+	}
+	if(*rng == NULL)
+		return 0;
+	if(e < ((*rng)->fatend - 1))
+		return e + 1;
+	*rng = fat_next_range(drv, range_ind);
+	return 0xfff;
+}
+
+/*
+	Entries 2n and 2n + 1 share the three bytes at 3n. A sector boundary can fall in
+	the middle of a group, so the groups at either end of the request are built whole
+	and only the bytes that belong to it are copied out. Everything in between is
+	written a run at a time.
+*/
+static int read_sector_fat12(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer) {
+	cluster_t ent, e0, e1;
+	size_t off, rem, skip, n;
+	uint8_t grp[3];
+	int range_ind;
+	vdf_filerange *rng;
+
+	off = (size_t)sector * drv->bps;
+	rem = (size_t)scnt * drv->bps;
+	ent = (off / 3) * 2;
+	skip = off % 3;
+
+	range_ind = ctx->fat_range;
+	rng = NULL;
+	if(ent >= 2) {
+		rng = find_range_fat_entry(drv, ent, &range_ind);
+		if(rng == NULL)
+			goto finish;
+	}
+#ifdef WRITE_DEBUG
+	printf("FAT: Start ent: %u\n", ent);
+#endif
+	while(rem != 0) {
+		if((skip == 0) && (rng != NULL) && ((ent + 1) < (rng->fatend - 1)) && (rem >= 3)) {
+			/* both entries of each group point at the next cluster */
+			n = ((rng->fatend - 1) - ent) / 2;
+			if(n > (rem / 3))
+				n = rem / 3;
+			fat_fill12(buffer, ent + 1, n);
+			ent += n * 2;
+			buffer += n * 3;
+			rem -= n * 3;
+			continue;
+		}
+		e0 = fat12_next_entry(drv, &ent, &rng, &range_ind);
+		e1 = fat12_next_entry(drv, &ent, &rng, &range_ind);
+		grp[0] = e0 & 0xff;
+		grp[1] = ((e0 >> 8) & 0x0f) | ((e1 << 4) & 0xf0);
+		grp[2] = (e1 >> 4) & 0xff;
+		n = 3 - skip;
+		if(n > rem)
+			n = rem;
+		memcpy(buffer, grp + skip, n);
+		buffer += n;
+		rem -= n;
+		skip = 0;
+		if((rng == NULL) && (ent > 2))
+			break;
+	}
+finish:
+	ctx->fat_range = range_ind;
+	if(rem != 0)
+		memset(buffer, 0, rem);
+
+	return 0;
+}
+
+int read_sector_fat(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer) {
+	cluster_t ent;
+	size_t n;
 	int i, range_ind;
-	vdf_file *file;
+	vdf_filerange *rng;
 
+	if(drv->filesys == VDF_FAT12)
+		return read_sector_fat12(drv, ctx, sector, scnt, buffer);
 	scnt *= drv->bps;
 	if(sector == 0) {
 		ent = 2;
-		switch(drv->filesys) {
-			case VDF_FAT12:
-				halfent = 0;
-				i = 3;
-				buffer[0] = 0xf8;
-				buffer[1] = 0xff;
-				buffer[2] = 0xff;
-				break;
-			case VDF_FAT16:
-				i = 4;
-				*(uint16_t*)buffer = le_16(0xfff8);
-				*(uint16_t*)(buffer + 2) = le_16(0xffff);
-				break;
-			case VDF_FAT32:
-				i = 8;
-				*(uint32_t*)buffer = le_32(0x0ffffff8);
-				*(uint32_t*)(buffer + 4) = le_32(0x0fffffff);
-				break;
+		if(drv->filesys == VDF_FAT16) {
+			i = 4;
+			*(uint16_t*)buffer = le_16(0xfff8);
+			*(uint16_t*)(buffer + 2) = le_16(0xffff);
+		} else {
+			i = 8;
+			*(uint32_t*)buffer = le_32(0x0ffffff8);
+			*(uint32_t*)(buffer + 4) = le_32(0x0fffffff);
 		}
 	} else {
 		i = 0;
-		switch(drv->filesys) {
-			case VDF_FAT12:
-				ent = ((sector * 2) * drv->bps) / 3;
-				halfent = ent & 1;
-				ent >>= 1;
-				break;
-			case VDF_FAT16:
-				ent = sector * (drv->bps / 2);
-				break;
-			case VDF_FAT32:
-				ent = sector * (drv->bps / 4);
-				break;
-		}
+		if(drv->filesys == VDF_FAT16)
+			ent = sector * (drv->bps / 2);
+		else
+			ent = sector * (drv->bps / 4);
 	}
 	buffer += i;
 
-	file = find_file_fat_entry(drv, ent, &range_ind);
-	if(file != NULL)
-		//clust = file->start + 1;
-		clust = ent + 1;
-	else
+	range_ind = ctx->fat_range;
+	rng = find_range_fat_entry(drv, ent, &range_ind);
+	if(rng == NULL)
 		goto finish;
 #ifdef WRITE_DEBUG
 	printf("FAT: Start ent: %u\n", ent);
 #endif
-	switch(drv->filesys) {
-		case VDF_FAT12:
-			for(; i<scnt;) {
-				if(ent < (file->end - 1)) {
-#ifdef WRITE_DEBUG
-					printf("%u: %u\n", ent, clust);
-#endif
-					if(halfent) {
-						*buffer &= 0xf0;
-						*buffer++ |= (clust << 4) & 0xf0;
-						i++;
-						if(i < (scnt - 1)) {
-							*buffer++ = (clust >> 4) & 0xff;
-							i++;
-						}
-					} else {
-						*buffer++ = clust & 0xff;
-						i++;
-						if(i < (scnt - 1))
-							*buffer = (clust >> 8) & 0xf;
-					}
-					clust++;
-					ent++;
-				} else {
-#ifdef WRITE_DEBUG
-					printf("%u: <end>\n", ent);
-#endif
-					if(halfent) {
-						*buffer++ |= 0xf0;
-						if(i < (scnt - 1))
-							*buffer++ = 0xff;
-						i += 2;
-					} else {
-						*buffer++ = 0xff;
-						if(i < (scnt - 1))
-							*buffer = 0xf;
-						i++;
-					}
-					file = fat_next_file(drv, ++ent, file, &range_ind);
-					if(file == NULL) {
-						if(!halfent) {
-							i++;
-							buffer++;
-						}
-						goto finish;
-					}
-//					clust = file->start + 1;
-					clust = ent + 1;
-				}
-				halfent = !halfent;
-			}
-			break;
-		case VDF_FAT16:
-			for(; i<scnt; i+=2, buffer+=2) {
-				if(ent < (file->end - 1)) {
-#ifdef WRITE_DEBUG
-					printf("%u: %u\n", ent, clust);
-#endif
-					*(uint16_t*)buffer = le_16(clust++);
-					ent++;
-				} else {
-#ifdef WRITE_DEBUG
-					printf("%u: <end>\n", ent);
-#endif
-					*(uint16_t*)buffer = le_16(0xffff);
-					file = fat_next_file(drv, ++ent, file, &range_ind);
-					if(file == NULL) {
-						buffer += 2;
-						i += 2;
-						goto finish;
-					}
-//					clust = file->start + 1;
-					clust = ent + 1;
-				}
+	if(drv->filesys == VDF_FAT16) {
+		while(i < scnt) {
+			if(ent < (rng->fatend - 1)) {
+				/* every entry before the file's last cluster points at the next one */
+				n = (rng->fatend - 1) - ent;
+				if(n > ((scnt - i) / 2))
+					n = (scnt - i) / 2;
+				fat_fill16(buffer, ent + 1, n);
+				ent += n;
+				buffer += n * 2;
+				i += n * 2;
+				continue;
 			}
-			break;
-		case VDF_FAT32:
-			for(; i<scnt; i+=4, buffer+=4) {
-				if(ent < (file->end - 1)) {
-#ifdef WRITE_DEBUG
-					printf("%u: %u\n", ent, clust);
-#endif
-					*(uint32_t*)buffer = le_32(clust++);
-					ent++;
-				} else {
-#ifdef WRITE_DEBUG
-					printf("%u: <end>\n", ent);
-#endif
-					*(uint32_t*)buffer = le_32(0x0fffffff);
-					file = fat_next_file(drv, ++ent, file, &range_ind);
-					if(file == NULL) {
-						buffer += 4;
-						i += 4;
-						goto finish;
-					}
-//					clust = file->start + 1;
-					clust = ent + 1;
-				}
+			*(uint16_t*)buffer = le_16(0xffff);
+			buffer += 2;
+			i += 2;
+			ent++;
+			rng = fat_next_range(drv, &range_ind);
+			if(rng == NULL)
+				goto finish;
+		}
+	} else {
+		while(i < scnt) {
+			if(ent < (rng->fatend - 1)) {
+				n = (rng->fatend - 1) - ent;
+				if(n > ((scnt - i) / 4))
+					n = (scnt - i) / 4;
+				fat_fill32(buffer, ent + 1, n);
+				ent += n;
+				buffer += n * 4;
+				i += n * 4;
+				continue;
 			}
-			break;
+			*(uint32_t*)buffer = le_32(0x0fffffff);
+			buffer += 4;
+			i += 4;
+			ent++;
+			rng = fat_next_range(drv, &range_ind);
+			if(rng == NULL)
+				goto finish;
+		}
 	}
 finish:
+	ctx->fat_range = range_ind;
 	i = scnt - i;
 	if(i != 0)
 		memset(buffer, 0, i);
@@ -0,0 +1,204 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <vdf.h>
+#include "vdf_fatgen.h"
+
+/*
+	Most of a FAT is runs of entries that each point at the next cluster, so the
+	generator spends nearly all of its time writing incrementing numbers. These kernels
+	keep a vector of consecutive cluster numbers and add the lane count to it for each
+	store. The best kernel the CPU supports is picked on first use.
+*/
+
+#ifndef DISABLE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define FATGEN_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define FATGEN_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#define FATGEN_NEON
+#include <arm_neon.h>
+#endif
+#endif /* DISABLE_SIMD */
+
+typedef void (*fill_func)(uint8_t *dst, cluster_t first, size_t cnt);
+
+static void fill16_scalar(uint8_t *dst, cluster_t first, size_t cnt) {
+	uint16_t *d = (uint16_t*)dst;
+	while(cnt--)
+		*d++ = le_16((uint16_t)first++);
+}
+
+static void fill32_scalar(uint8_t *dst, cluster_t first, size_t cnt) {
+	uint32_t *d = (uint32_t*)dst;
+	while(cnt--)
+		*d++ = le_32(first++);
+}
+
+#ifdef FATGEN_SSE2
+static void fill16_sse2(uint8_t *dst, cluster_t first, size_t cnt) {
+	__m128i v, step;
+	uint16_t f = (uint16_t)first;
+
+	v = _mm_setr_epi16(f, f + 1, f + 2, f + 3, f + 4, f + 5, f + 6, f + 7);
+	step = _mm_set1_epi16(8);
+	for(; cnt >= 8; cnt -= 8, dst += 16) {
+		_mm_storeu_si128((__m128i*)dst, v);
+		v = _mm_add_epi16(v, step);
+	}
+	fill16_scalar(dst, (uint16_t)_mm_cvtsi128_si32(v), cnt);
+}
+
+static void fill32_sse2(uint8_t *dst, cluster_t first, size_t cnt) {
+	__m128i v, step;
+
+	v = _mm_setr_epi32(first, first + 1, first + 2, first + 3);
+	step = _mm_set1_epi32(4);
+	for(; cnt >= 4; cnt -= 4, dst += 16) {
+		_mm_storeu_si128((__m128i*)dst, v);
+		v = _mm_add_epi32(v, step);
+	}
+	fill32_scalar(dst, _mm_cvtsi128_si32(v), cnt);
+}
+#endif
+
+#ifdef FATGEN_AVX2
+__attribute__((target("avx2")))
+static void fill16_avx2(uint8_t *dst, cluster_t first, size_t cnt) {
+	__m256i v, step;
+	uint16_t f = (uint16_t)first;
+
+	v = _mm256_setr_epi16(f, f + 1, f + 2, f + 3, f + 4, f + 5, f + 6, f + 7,
+		f + 8, f + 9, f + 10, f + 11, f + 12, f + 13, f + 14, f + 15);
+	step = _mm256_set1_epi16(16);
+	for(; cnt >= 16; cnt -= 16, dst += 32) {
+		_mm256_storeu_si256((__m256i*)dst, v);
+		v = _mm256_add_epi16(v, step);
+	}
+	fill16_scalar(dst, (uint16_t)_mm256_extract_epi16(v, 0), cnt);
+}
+
+__attribute__((target("avx2")))
+static void fill32_avx2(uint8_t *dst, cluster_t first, size_t cnt) {
+	__m256i v, step;
+
+	v = _mm256_setr_epi32(first, first + 1, first + 2, first + 3, first + 4, first + 5, first + 6, first + 7);
+	step = _mm256_set1_epi32(8);
+	for(; cnt >= 8; cnt -= 8, dst += 32) {
+		_mm256_storeu_si256((__m256i*)dst, v);
+		v = _mm256_add_epi32(v, step);
+	}
+	fill32_scalar(dst, _mm256_extract_epi32(v, 0), cnt);
+}
+#endif
+
+#ifdef FATGEN_NEON
+static void fill16_neon(uint8_t *dst, cluster_t first, size_t cnt) {
+	static const uint16_t lanes[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	uint16x8_t v, step;
+
+	v = vaddq_u16(vdupq_n_u16((uint16_t)first), vld1q_u16(lanes));
+	step = vdupq_n_u16(8);
+	for(; cnt >= 8; cnt -= 8, dst += 16) {
+		vst1q_u16((uint16_t*)dst, v);
+		v = vaddq_u16(v, step);
+	}
+	fill16_scalar(dst, vgetq_lane_u16(v, 0), cnt);
+}
+
+static void fill32_neon(uint8_t *dst, cluster_t first, size_t cnt) {
+	static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+	uint32x4_t v, step;
+
+	v = vaddq_u32(vdupq_n_u32(first), vld1q_u32(lanes));
+	step = vdupq_n_u32(4);
+	for(; cnt >= 4; cnt -= 4, dst += 16) {
+		vst1q_u32((uint32_t*)dst, v);
+		v = vaddq_u32(v, step);
+	}
+	fill32_scalar(dst, vgetq_lane_u32(v, 0), cnt);
+}
+#endif
+
+static fill_func fill16 = NULL;
+static fill_func fill32 = NULL;
+
+/* Several threads may get here at once, but they all pick the same kernels */
+static void select_kernels(void) {
+	fill_func f16 = fill16_scalar, f32 = fill32_scalar;
+
+#if defined(FATGEN_NEON)
+	f16 = fill16_neon;
+	f32 = fill32_neon;
+#else
+#if defined(FATGEN_SSE2)
+	f16 = fill16_sse2;
+	f32 = fill32_sse2;
+#endif
+#if defined(FATGEN_AVX2)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		f16 = fill16_avx2;
+		f32 = fill32_avx2;
+	}
+#endif
+#endif
+	fill16 = f16;
+	fill32 = f32;
+}
+
+void fat_fill16(uint8_t *dst, cluster_t first, size_t cnt) {
+	if(fill16 == NULL)
+		select_kernels();
+	fill16(dst, first, cnt);
+}
+
+void fat_fill32(uint8_t *dst, cluster_t first, size_t cnt) {
+	if(fill32 == NULL)
+		select_kernels();
+	fill32(dst, first, cnt);
+}
+
+/*
+	FAT12 packs two entries into three bytes, which no vector store lines up with.
+	A FAT12 FAT is at most 6KiB anyway, so one 24 bit group per iteration is plenty.
+*/
+void fat_fill12(uint8_t *dst, cluster_t first, size_t pairs) {
+	uint32_t v;
+
+	while(pairs--) {
+		v = (first & 0xfff) | (((first + 1) & 0xfff) << 12);
+		dst[0] = v & 0xff;
+		dst[1] = (v >> 8) & 0xff;
+		dst[2] = (v >> 16) & 0xff;
+		dst += 3;
+		first += 2;
+	}
+}
@@ -0,0 +1,220 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+#include "vdf_fdcache.h"
+
+#ifdef _MSC_VER
+#define OPEN_FLAGS		_O_RDONLY | _O_BINARY
+#else
+#define OPEN_FLAGS		O_RDONLY
+#endif
+
+/* Descriptors for real files are kept open between reads while the drive is locked, so
+   that streaming a file doesn't cost an open() and close() for every request. The drive
+   keeps the cached descriptors on a LRU list and closes the least recently used one that
+   isn't currently being read from once fd_max is reached. They are all closed when the
+   drive is unlocked. */
+
+void fdcache_init(vdf_drive *drv) {
+	INIT_LIST_HEAD(&drv->fd_lru);
+	drv->fd_cnt = 0;
+	drv->fd_max = DEFAULT_FD_CACHE_SIZE;
+	mutex_init(&drv->fd_lock);
+}
+
+static void uncache(vdf_file *file) {
+	close(file->real.fd);
+	file->real.fd = -1;
+	file->real.fd_ref = 0;
+	list_del(&file->real.fd_lru);
+	file->drv->fd_cnt--;
+}
+
+static void evict(vdf_drive *drv, int max) {
+	vdf_file *fil, *fil_n;
+	list_foreach_item_rev_safe(vdf_file, fil, fil_n, &drv->fd_lru, real.fd_lru) {
+		if(drv->fd_cnt <= max)
+			break;
+		if(fil->real.fd_ref == 0)
+			uncache(fil);
+	}
+}
+
+void fdcache_free(vdf_drive *drv) {
+	vdf_file *fil, *fil_n;
+	list_foreach_item_safe(vdf_file, fil, fil_n, &drv->fd_lru, real.fd_lru) {
+		uncache(fil);
+	}
+	mutex_destroy(&drv->fd_lock);
+}
+
+/* close every cached descriptor. called when the drive is unlocked, so that a host file
+   replaced before the next lock is opened again rather than read through its old inode */
+void fdcache_flush(vdf_drive *drv) {
+	vdf_file *fil, *fil_n;
+
+	mutex_lock(&drv->fd_lock);
+	list_foreach_item_safe(vdf_file, fil, fil_n, &drv->fd_lru, real.fd_lru) {
+		if(fil->real.fd_ref == 0)
+			uncache(fil);
+	}
+	mutex_unlock(&drv->fd_lock);
+}
+
+int fdcache_get(vdf_file *file) {
+	vdf_drive *drv = file->drv;
+	int fd;
+
+	mutex_lock(&drv->fd_lock);
+	if(file->real.fd != -1) {
+#ifndef HAVE_PREAD
+		/* without pread() a read seeks the descriptor, so it can't be shared. a reader
+		   that finds it in use gets a descriptor of its own */
+		if(file->real.fd_ref != 0) {
+			mutex_unlock(&drv->fd_lock);
+			return open(file->real.path, OPEN_FLAGS);
+		}
+#endif
+		goto cached;
+	}
+	mutex_unlock(&drv->fd_lock);
+
+	fd = open(file->real.path, OPEN_FLAGS);
+	if(fd == -1)
+		return -1;
+
+	mutex_lock(&drv->fd_lock);
+	if(file->real.fd != -1) {
+		/* another reader opened it while we weren't holding the lock */
+#ifndef HAVE_PREAD
+		if(file->real.fd_ref != 0) {
+			mutex_unlock(&drv->fd_lock);
+			return fd;
+		}
+#endif
+		close(fd);
+		goto cached;
+	}
+	if(drv->fd_cnt >= drv->fd_max)
+		evict(drv, drv->fd_max - 1);
+	if(drv->fd_cnt < drv->fd_max) {
+		file->real.fd = fd;
+		file->real.fd_ref = 1;
+		list_add(&file->real.fd_lru, &drv->fd_lru);
+		drv->fd_cnt++;
+	}
+	/* if every cached descriptor is in use, fd is returned uncached and closed by fdcache_put() */
+	mutex_unlock(&drv->fd_lock);
+	return fd;
+
+cached:
+	file->real.fd_ref++;
+	list_del(&file->real.fd_lru);
+	list_add(&file->real.fd_lru, &drv->fd_lru);
+	fd = file->real.fd;
+	mutex_unlock(&drv->fd_lock);
+	return fd;
+}
+
+void fdcache_put(vdf_file *file, int fd) {
+	vdf_drive *drv = file->drv;
+
+	mutex_lock(&drv->fd_lock);
+	if(fd == file->real.fd) {
+		file->real.fd_ref--;
+		mutex_unlock(&drv->fd_lock);
+		return;
+	}
+	mutex_unlock(&drv->fd_lock);
+	close(fd);
+}
+
+void fdcache_close(vdf_file *file) {
+	vdf_drive *drv = file->drv;
+
+	mutex_lock(&drv->fd_lock);
+	if(file->real.fd != -1)
+		uncache(file);
+	mutex_unlock(&drv->fd_lock);
+}
+
+ssize_t file_pread(int fd, void *buffer, size_t cnt, fileoff_t off) {
+	uint8_t *b = buffer;
+	ssize_t r, total = 0;
+
+#ifndef HAVE_PREAD
+	if(lseek(fd, off, SEEK_SET) == -1)
+		return -1;
+#endif
+	while(total < cnt) {
+#ifdef HAVE_PREAD
+		r = pread(fd, b, cnt - total, off + total);
+#else
+		r = read(fd, b, cnt - total);
+#endif
+		if(r == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(r == 0)
+			break;
+		b += r;
+		total += r;
+	}
+	return total;
+}
+
+LIBFUNC int vdf_set_drive_fd_cache(vdf_drive *drv, int max_fds) {
+	if(!drive_is_valid(drv) || (max_fds < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	mutex_lock(&drv->fd_lock);
+	drv->fd_max = max_fds;
+	evict(drv, max_fds);
+	mutex_unlock(&drv->fd_lock);
+	return 0;
+}
+
+LIBFUNC int vdf_get_drive_fd_cache(vdf_drive *drv) {
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return drv->fd_max;
+}
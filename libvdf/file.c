@@ -27,10 +27,9 @@
 #include <string.h>
 #ifdef _MSC_VER
 #define strcasecmp(s1,s2)	_strcmpi(s1,s2)
-#include <malloc.h>
+#define strncasecmp(s1,s2,n)	_strnicmp(s1,s2,n)
 #else
 #include <strings.h>
-#include <alloca.h>
 #endif
 #include <ctype.h>
 #include <time.h>
@@ -41,8 +40,12 @@
 #include "vdf_drive.h"
 #include "vdf_file.h"
 #include "vdf_transport.h"
+#include "vdf_fdcache.h"
+#include "vdf_mmap.h"
+#include "vdf_pathcache.h"
+#include "vdf_arena.h"
 
-static vdf_file *create_file(vdf_file *parent, const char *name);
+static vdf_file *create_file(vdf_drive *drv, vdf_file *parent, const char *name);
 static int calc_shortname(vdf_file *fil);
 static int file_is_deleted(vdf_file *fil);
 static vdf_file *find_file_skip(vdf_file *dir, const char *name, int flags, vdf_file *skip);
@@ -72,20 +75,371 @@ int stuff_dosname(char **d, char s) {
 	return 0;
 }
 
-static int calc_shortname(vdf_file *fil) {
-	int ind;
-	char shortname[13], *s, *sp, *d, *dp;
+/* Directory entries are generated for every read, so the parts of them that only change
+   when the file is renamed or redated are worked out here, once. */
+static void encode_shortname(vdf_file *fil) {
+	const char *s = fil->shortname;
+	uint8_t chk;
 	int i;
 
-	sp = strrchr(fil->name, '.');
+	for(i=0; (*s) && (*s != '.') && (i < 8); i++, s++)
+		fil->dosname[i] = *s;
+	for(; i<8; i++)
+		fil->dosname[i] = ' ';
+	if(*s++ == '.') {
+		for(; (i<(8 + 3)) && (*s); i++, s++)
+			fil->dosname[i] = *s;
+	}
+	for(; i<(8 + 3); i++)
+		fil->dosname[i] = ' ';
+
+	chk = 0;
+	for(i=0; i<(8 + 3); i++)
+		chk = (chk >> 1) + ((chk & 1) << 7) + fil->dosname[i];
+	fil->chk = chk;
+}
+
+static void encode_date(vdf_file *fil) {
+	struct tm t;
+	int year;
+
+#ifdef _MSC_VER
+	if(gmtime_s(&t, &fil->date) != 0)
+#else
+	if(gmtime_r(&fil->date, &t) == NULL)
+#endif
+		memset(&t, 0, sizeof(t));
+	fil->fat_time = le_16(
+		((t.tm_hour & 0x1f) << 11) |
+		((t.tm_min  & 0x3f) << 5)  |
+		((t.tm_sec / 2) & 0x1f)
+	);
+	year = t.tm_year - 80;
+	if(year < 0)
+		year = 0;
+	else if(year > 127)
+		year = 127;
+	fil->fat_date = le_16(
+		((year & 0x7f) << 9)             |
+		(((t.tm_mon + 1) & 0x0f) << 5) |
+		(t.tm_mday & 0x1f)
+	);
+	fil->fat_time_10ms = (t.tm_sec & 1) ? 5 : 0;
+}
+
+/*
+	Each directory keeps two chained hash tables over its entries, one keyed on the long
+	name and one on the short name, both case folded the same way strcasecmp() compares.
+	The chain links live in the files themselves, since a file is only ever in one
+	directory. Small directories are searched linearly and get no tables. If a table
+	can't be grown the old one is kept (just with longer chains), and if there's none at
+	all find_file_skip() falls back to the list.
+*/
+#define DIR_HASH_MIN	16
+
+static uint32_t name_hash_n(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	while(len--)
+		h = (h ^ (uint8_t)tolower((uint8_t)*name++)) * 16777619u;
+	return h;
+}
+
+static INLINE uint32_t name_hash(const char *name) {
+	return name_hash_n(name, strlen(name));
+}
+
+/* the first 'len' characters of 'name' are all of 's', ignoring case */
+static INLINE int name_equal_n(const char *name, size_t len, const char *s) {
+	return !strncasecmp(name, s, len) && (s[len] == 0);
+}
+
+static void hash_add_name(vdf_file *fil) {
+	vdf_file *dir = fil->parent, **b;
+	if((dir == NULL) || (fil->name == NULL))
+		return;
+	fil->name_hash = name_hash(fil->name);
+	if(dir->dir.name_tab == NULL)
+		return;
+	b = &dir->dir.name_tab[fil->name_hash & (dir->dir.tab_size - 1)];
+	fil->name_next = *b;
+	*b = fil;
+}
+
+static void hash_add_short(vdf_file *fil) {
+	vdf_file *dir = fil->parent, **b;
+	if((dir == NULL) || (fil->shortname[0] == 0))
+		return;
+	fil->short_hash = name_hash(fil->shortname);
+	if(dir->dir.short_tab == NULL)
+		return;
+	b = &dir->dir.short_tab[fil->short_hash & (dir->dir.tab_size - 1)];
+	fil->short_next = *b;
+	*b = fil;
+}
+
+/* the removes are harmless for a file that isn't in the table */
+static void hash_del_name(vdf_file *fil) {
+	vdf_file *dir = fil->parent, **b;
+	if((dir == NULL) || (dir->dir.name_tab == NULL))
+		return;
+	for(b=&dir->dir.name_tab[fil->name_hash & (dir->dir.tab_size - 1)]; *b != NULL; b=&(*b)->name_next) {
+		if(*b == fil) {
+			*b = fil->name_next;
+			break;
+		}
+	}
+	fil->name_next = NULL;
+}
+
+static void hash_del_short(vdf_file *fil) {
+	vdf_file *dir = fil->parent, **b;
+	if((dir == NULL) || (dir->dir.short_tab == NULL))
+		return;
+	for(b=&dir->dir.short_tab[fil->short_hash & (dir->dir.tab_size - 1)]; *b != NULL; b=&(*b)->short_next) {
+		if(*b == fil) {
+			*b = fil->short_next;
+			break;
+		}
+	}
+	fil->short_next = NULL;
+}
+
+/*
+	Make room in the tables for 'cnt' entries. Called before a new entry is put on the
+	list, so the rehash only sees entries that are already hashed.
+*/
+void dir_hash_reserve(vdf_file *dir, int cnt) {
+	vdf_file *fil, **tab, **b;
+	int size;
+
+	if((cnt <= DIR_HASH_MIN) || (cnt <= dir->dir.tab_size))
+		return;
+	size = dir->dir.tab_size ? dir->dir.tab_size : DIR_HASH_MIN;
+	while(size < cnt)
+		size *= 2;
+	tab = calloc(size * 2, sizeof(vdf_file*));
+	if(tab == NULL)
+		return;
+	free(dir->dir.name_tab);
+	dir->dir.name_tab = tab;
+	dir->dir.short_tab = tab + size;
+	dir->dir.tab_size = size;
+	list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
+		if(fil->name != NULL) {
+			b = &dir->dir.name_tab[fil->name_hash & (size - 1)];
+			fil->name_next = *b;
+			*b = fil;
+		}
+		if(fil->shortname[0] != 0) {
+			b = &dir->dir.short_tab[fil->short_hash & (size - 1)];
+			fil->short_next = *b;
+			*b = fil;
+		}
+	}
+}
+
+static void set_shortname(vdf_file *fil, const char *shortname) {
+	hash_del_short(fil);
+	strcpy(fil->shortname, shortname);
+	hash_add_short(fil);
+	encode_shortname(fil);
+}
+
+/*
+	A numeric tail replaces the end of the basis, so every short name with a tail belongs
+	to a family made of the characters left in front of the '~', the width of the tail and
+	the extension. Each family remembers the lowest tail it hasn't handed out yet and a
+	heap of tails that have been given back, so a directory full of IMG_0001.JPEG style
+	names doesn't have to try ~1, ~2, ... for every file. Families are tried narrowest
+	first, which gives the same tail the old search did. A tail is still checked against
+	every long and short name in the directory before it's used, since a long name can
+	look like a tailed short name and vdf_set_file_shortname() can take any name.
+*/
+#define TAIL_WIDTH_MAX	6
+#define TAIL_FAM_MIN	16
+
+static vdf_tail_family *tail_family_get(vdf_file *dir, const char *key, int first) {
+	vdf_tail_family *fam, *n, **tab;
+	uint32_t h = name_hash(key);
+	int size, i;
+
+	if(dir->dir.fam_tab != NULL) {
+		for(fam=dir->dir.fam_tab[h & (dir->dir.fam_size - 1)]; fam != NULL; fam=fam->next) {
+			if((fam->hash == h) && !strcmp(fam->key, key))
+				return fam;
+		}
+	}
+	if(dir->dir.fam_cnt >= dir->dir.fam_size) {
+		size = dir->dir.fam_size ? dir->dir.fam_size * 2 : TAIL_FAM_MIN;
+		tab = calloc(size, sizeof(vdf_tail_family*));
+		if(tab == NULL)
+			return NULL;
+		for(i=0; i<dir->dir.fam_size; i++) {
+			for(fam=dir->dir.fam_tab[i]; fam != NULL; fam=n) {
+				n = fam->next;
+				fam->next = tab[fam->hash & (size - 1)];
+				tab[fam->hash & (size - 1)] = fam;
+			}
+		}
+		free(dir->dir.fam_tab);
+		dir->dir.fam_tab = tab;
+		dir->dir.fam_size = size;
+	}
+	fam = malloc(sizeof(vdf_tail_family));
+	if(fam == NULL)
+		return NULL;
+	memset(fam, 0, sizeof(vdf_tail_family));
+	fam->hash = h;
+	fam->next_tail = first;
+	strcpy(fam->key, key);
+	fam->next = dir->dir.fam_tab[h & (dir->dir.fam_size - 1)];
+	dir->dir.fam_tab[h & (dir->dir.fam_size - 1)] = fam;
+	dir->dir.fam_cnt++;
+	return fam;
+}
+
+static void tail_families_free(vdf_file *dir) {
+	vdf_tail_family *fam, *n;
+	int i;
+	for(i=0; i<dir->dir.fam_size; i++) {
+		for(fam=dir->dir.fam_tab[i]; fam != NULL; fam=n) {
+			n = fam->next;
+			free(fam->free);
+			free(fam);
+		}
+	}
+	free(dir->dir.fam_tab);
+}
+
+/* the lowest tail the family can hand out */
+static int tail_take(vdf_tail_family *fam) {
+	int *h = fam->free, tail, i, c, t;
+
+	if(fam->free_cnt == 0)
+		return fam->next_tail++;
+	tail = h[0];
+	t = h[--fam->free_cnt];
+	for(i=0; (c = (i * 2) + 1) < fam->free_cnt; i=c) {
+		if(((c + 1) < fam->free_cnt) && (h[c + 1] < h[c]))
+			c++;
+		if(t <= h[c])
+			break;
+		h[i] = h[c];
+	}
+	h[i] = t;
+	return tail;
+}
+
+/* give a tail back to its family. if the heap can't grow the tail is just never reused */
+static void tail_give(vdf_tail_family *fam, int tail) {
+	int *h, i, p;
+
+	if(fam->free_cnt == fam->free_size) {
+		i = fam->free_size ? fam->free_size * 2 : 8;
+		h = realloc(fam->free, sizeof(int) * i);
+		if(h == NULL)
+			return;
+		fam->free = h;
+		fam->free_size = i;
+	}
+	h = fam->free;
+	for(i=fam->free_cnt++; i > 0; i=p) {
+		p = (i - 1) / 2;
+		if(h[p] <= tail)
+			break;
+		h[i] = h[p];
+	}
+	h[i] = tail;
+}
+
+static void tail_release(vdf_file *fil) {
+	vdf_tail_family *fam = fil->tail_fam;
+
+	if(fam == NULL)
+		return;
+	fil->tail_fam = NULL;
+	tail_give(fam, fil->tail);
+}
+
+/*
+	Put the first free numeric tail on 'shortname', which has 'blen' characters of basis.
+	The basis is cut short if the tail doesn't fit after it.
+*/
+static int tail_alloc(vdf_file *fil, char *shortname, int blen) {
+	vdf_file *dir = fil->parent;
+	vdf_tail_family *fam;
+	char key[16], ext[5];
+	int w, lo, hi, ind, n, i, found;
+	int *taken = NULL, *t, taken_cnt, taken_size = 0;
+
+	strcpy(ext, shortname + blen);
+	for(w=1, lo=1, hi=9; w<=TAIL_WIDTH_MAX; w++, lo=hi+1, hi=(hi*10)+9) {
+		n = 8 - (w + 1);
+		if(blen < n)
+			n = blen;
+		memcpy(key, shortname, n);
+		sprintf(key + n, "~%d%s", w, ext);
+		fam = tail_family_get(dir, key, lo);
+		ind = lo - 1;
+		taken_cnt = 0;
+		found = 0;
+		for(;;) {
+			if(fam == NULL)
+				ind++;
+			else if((fam->free_cnt != 0) || (fam->next_tail <= hi))
+				ind = tail_take(fam);
+			else
+				break;
+			if(ind > hi)
+				break;
+			sprintf(shortname + n, "~%d%s", ind, ext);
+			if(find_file_skip(dir, shortname, 0, fil) == NULL) {
+				found = 1;
+				break;
+			}
+			/* in use by a name the family didn't hand out. it goes back once the search is over,
+			   so it can be handed out when that name goes */
+			if(fam == NULL)
+				continue;
+			if(taken_cnt == taken_size) {
+				i = taken_size ? taken_size * 2 : 8;
+				t = realloc(taken, sizeof(int) * i);
+				if(t == NULL)
+					continue;
+				taken = t;
+				taken_size = i;
+			}
+			taken[taken_cnt++] = ind;
+		}
+		for(i=0; i<taken_cnt; i++)
+			tail_give(fam, taken[i]);
+		if(found) {
+			free(taken);
+			fil->tail_fam = fam;
+			fil->tail = ind;
+			return 0;
+		}
+	}
+	free(taken);
+	errno = EEXIST;
+	return -1;
+}
+
+/* the short name 'name' starts out as, before any tail. returns the length of the basis */
+static int shortname_basis(const char *name, char *shortname) {
+	const char *s, *sp;
+	char *d;
+	int i, blen;
+
+	sp = strrchr(name, '.');
 	if(sp == NULL)
-		sp = strchr(fil->name, 0);
+		sp = strchr(name, 0);
 
-	s = fil->name;
+	s = name;
 	d = shortname;
 	for(i=0; (i < 8) && (s < sp); i++)
 		stuff_dosname(&d, *s++);
-	dp = d - 1;
+	blen = d - shortname;
 	if(*sp) {
 		s = sp + 1;
 		*d++ = '.';
@@ -93,44 +447,44 @@ static int calc_shortname(vdf_file *fil) {
 			stuff_dosname(&d, *s++);
 	}
 	*d = 0;
+	return blen;
+}
+
+/* the name can be used as its own short name, so it never needs a tail */
+int name_is_short(const char *name) {
+	char shortname[13];
+	shortname_basis(name, shortname);
+	return !strcmp(shortname, name);
+}
+
+static int calc_shortname(vdf_file *fil) {
+	char shortname[13];
+	int blen;
+
+	tail_release(fil);
+	blen = shortname_basis(fil->name, shortname);
 
 	if(!strcmp(shortname, fil->name)) {
-		strcpy(fil->shortname, shortname);
+		set_shortname(fil, shortname);
 		fil->flags &= ~VFF_LONGNAME;
+		dir_set_dirty(fil->parent, VFF_RECOUNT);
 		set_drive_dirty(fil->drv);
 		return 0;
 	}
 
-	if((dp - shortname) >= 7) {
-		for(ind=1; ind<1000000; ind++) {
-			d = dp;
-			*d-- = (ind % 10) + '0';
-			if(ind >= 10)
-				*d-- = ((ind / 10) % 10) + '0';
-			if(ind >= 100)
-				*d-- = ((ind / 100) % 10) + '0';
-			if(ind >= 1000)
-				*d-- = ((ind / 1000) % 10) + '0';
-			if(ind >= 10000)
-				*d-- = ((ind / 10000) % 10) + '0';
-			if(ind >= 10000)
-				*d-- = ((ind / 10000) % 10) + '0';
-			if(ind >= 100000)
-				*d-- = ((ind / 100000) % 10) + '0';
-			*d = '~';
-			if(find_file_skip(vdf_parent_dir(fil), shortname, VFF_SHORTONLY, fil) == NULL)
-				break;
-		}
-		if(ind == 1000000)
+	/* a name that only differs by case keeps its short name as is, unless the basis is full */
+	if((blen == 8) || strcasecmp(shortname, fil->name)) {
+		if(tail_alloc(fil, shortname, blen) == -1)
 			return -1;
 	}
-	strcpy(fil->shortname, shortname);
+	set_shortname(fil, shortname);
 	fil->flags |= VFF_LONGNAME;
+	dir_set_dirty(fil->parent, VFF_RECOUNT);
 	set_drive_dirty(fil->drv);
 	return 0;
 }
 
-static vdf_file *create_file(vdf_file *parent, const char *name) {
+static vdf_file *create_file(vdf_drive *drv, vdf_file *parent, const char *name) {
 	vdf_file *fil;
 
 	if(parent != NULL) {
@@ -168,64 +522,69 @@ static vdf_file *create_file(vdf_file *parent, const char *name) {
 		}
 	}
 
-	fil = malloc(sizeof(vdf_file));
-	if(fil == NULL) {
-		errno = ENOMEM;
+	fil = arena_file_alloc(drv);
+	if(fil == NULL)
 		return NULL;
-	}
-	memset(fil, 0, sizeof(vdf_file));
+	fil->drv = drv;
 	fil->fatsize = fil->fatclusters = -1;
 	fil->attr = VFA_ATTRIBUTE;
+	fil->range_ind = -1;
+	encode_date(fil);
 
 	fil->parent = parent;
 	if(parent != NULL) {
-		fil->drv = parent->drv;
+		dir_hash_reserve(parent, parent->dir.cnt + 1);
 		list_add_tail(&fil->dirlist, &parent->dir.entries);
 		list_add_tail(&fil->alllist, &fil->drv->all_files);
 		parent->dir.cnt++;
 		fil->drv->file_cnt++;
+		fil->seq = fil->drv->next_seq++;
+		dir_set_dirty(parent, VFF_RECOUNT);
 		set_drive_dirty(fil->drv);
 	} else {
 		fil->alllist.next = fil->alllist.prev = NULL;
 	}
 
 	if(name != NULL) {
-		fil->name = strdup(name);
-		if(fil->name == NULL) {
-			errno = ENOMEM;
+		fil->name = arena_strdup(drv, name);
+		if(fil->name == NULL)
 			goto exit_err;
-		}
+		hash_add_name(fil);
 		if(calc_shortname(fil) == -1)
 			goto exit_err;
 	}
 	return fil;
 exit_err:
 	if(parent != NULL) {
+		hash_del_name(fil);
+		hash_del_short(fil);
 		list_del(&fil->dirlist);
 		list_del(&fil->alllist);
 	}
 	if(fil->name != NULL)
-		free(fil->name);
-	free(fil);
+		arena_strfree(drv, fil->name);
+	arena_file_release(drv, fil);
 	return NULL;
 }
 
-static vdf_file *create_dir(vdf_file *parent, const char *name) {
+static vdf_file *create_dir(vdf_drive *drv, vdf_file *parent, const char *name) {
 	vdf_file *dir;
-	dir = create_file(parent, name);
+	dir = create_file(drv, parent, name);
 	if(dir == NULL)
 		return NULL;
 	dir->attr |= VFA_DIR;
 	dir->dir.cnt = 0;
 	INIT_LIST_HEAD(&dir->dir.entries);
+	list_add_tail(&dir->dir.alldirs, &drv->all_dirs);
+	if(parent != NULL)
+		dir_set_dirty(dir, VFF_RECOUNT);
 	return dir;
 }
 
 vdf_file *create_root_dir(vdf_drive *drv) {
-	vdf_file *dir = create_dir(NULL, NULL);
+	vdf_file *dir = create_dir(drv, NULL, NULL);
 	if(dir == NULL)
 		return NULL;
-	dir->drv = drv;
 	dir->flags = VFF_ROOTDIR;
 	if(drv->filesys == VDF_FAT32) {
 		list_add_tail(&dir->alllist, &drv->all_files);
@@ -241,7 +600,7 @@ LIBFUNC vdf_file *vdf_add_dir(vdf_file *parent, const char *name) {
 		errno = EINVAL;
 		return NULL;
 	}
-	dir = create_dir(parent, name);
+	dir = create_dir(parent->drv, parent, name);
 	if(dir == NULL)
 		return NULL;
 	vdf_set_file_date(dir, time(NULL));
@@ -249,10 +608,7 @@ LIBFUNC vdf_file *vdf_add_dir(vdf_file *parent, const char *name) {
 }
 
 LIBFUNC vdf_file *vdf_add_file_real(vdf_file *parent, const char *name, const char *path, int flags) {
-	vdf_file *fil;
 	struct stat st;
-	char *p;
-	size_t size;
 
 	if((parent == NULL) || (path == NULL)) {
 		errno = EINVAL;
@@ -288,21 +644,31 @@ LIBFUNC vdf_file *vdf_add_file_real(vdf_file *parent, const char *name, const ch
 		}
 	}
 found:
-	p = strdup(path);
-	if(path == NULL)
+	return file_add_real(parent, name, path, st.st_size, st.st_ctime, flags);
+}
+
+/* vdf_add_file_real() for a file that has already been looked at */
+vdf_file *file_add_real(vdf_file *parent, const char *name, const char *path, filesz_t size, time_t date, int flags) {
+	vdf_file *fil;
+	char *p;
+
+	p = arena_strdup(parent->drv, path);
+	if(p == NULL)
 		return NULL;
-	fil = create_file(parent, name);
+	fil = create_file(parent->drv, parent, name);
 	if(fil == NULL) {
-		free(p);
+		arena_strfree(parent->drv, p);
 		return NULL;
 	}
-	size = st.st_size;
 	fil->size = size;
-	size += fil->drv->bpc - 1;
-	size /= fil->drv->bpc;
-	fil->clusters = size;
-	vdf_set_file_date(fil, st.st_ctime);
+	fil->clusters = ((size_t)size + (fil->drv->bpc - 1)) / fil->drv->bpc;
+	vdf_set_file_date(fil, date);
 	fil->real.path = p;
+	fil->real.fd = -1;
+	if(flags & VAF_MMAP) {
+		fil->flags |= VFF_MMAP;
+		fil->drv->mmap_file_cnt++;
+	}
 	return fil;
 }
 
@@ -312,11 +678,32 @@ LIBFUNC vdf_file *vdf_add_file_virt(vdf_file *parent, const char *name, size_t l
 		errno = EINVAL;
 		return NULL;
 	}
-	fil = create_file(parent, name);
+	fil = create_file(parent->drv, parent, name);
 	if(fil == NULL)
 		return NULL;
 	fil->flags |= VFF_VIRT;
+	if(flags & VAF_READAHEAD)
+		fil->flags |= VFF_READAHEAD;
 	fil->virt.cback = cback;
+	fil->virt.acback = NULL;
+	fil->virt.param = param;
+	vdf_set_file_size(fil, len);
+	vdf_set_file_date(fil, time(NULL));
+	return fil;
+}
+
+LIBFUNC vdf_file *vdf_add_file_async(vdf_file *parent, const char *name, size_t len, vdf_file_async_callback cback, void *param, int flags) {
+	vdf_file *fil;
+	if((parent == NULL) || (name == NULL) || (cback == NULL) || (flags != 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	fil = create_file(parent->drv, parent, name);
+	if(fil == NULL)
+		return NULL;
+	fil->flags |= VFF_VIRT | VFF_ASYNC;
+	fil->virt.cback = NULL;
+	fil->virt.acback = cback;
 	fil->virt.param = param;
 	vdf_set_file_size(fil, len);
 	vdf_set_file_date(fil, time(NULL));
@@ -325,23 +712,61 @@ LIBFUNC vdf_file *vdf_add_file_virt(vdf_file *parent, const char *name, size_t l
 
 int delete_file(vdf_file *file) {
 	vdf_file *sfil, *sfil_n;
+	vdf_drive *drv = file->drv;
 	file->flags |= VFF_DELETED;
-	file->drv->file_cnt--;
+	drv->file_cnt--;
 	if(file->alllist.next != NULL)
 		list_del(&file->alllist);
-	if(vdf_file_is_dir(file)) {
-		list_foreach_item_safe(vdf_file, sfil, sfil_n, &file->parent->dir.entries, dirlist) {
+	/* everything from its range on moves up */
+	if((file->range_ind != -1) && (file->range_ind < drv->relayout))
+		drv->relayout = file->range_ind;
+	if(file->attr & VFA_DIR) {
+		list_foreach_item_safe(vdf_file, sfil, sfil_n, &file->dir.entries, dirlist) {
 			delete_file(sfil);
 		}
-	} else if(vdf_file_is_real(file)) {
-		free(file->real.path);
+		if(file->flags & (VFF_RECOUNT | VFF_REENCODE))
+			list_del(&file->dir.dirty);
+		list_del(&file->dir.alldirs);
+		dir_free_tables(file);
+	} else if(!(file->flags & VFF_VIRT)) {
+		if(file->flags & VFF_MMAP)
+			drv->mmap_file_cnt--;
+		file_unmap(file);
+		fdcache_close(file);
+		arena_strfree(drv, file->real.path);
 	}
 	if(!(file->flags & VFF_ROOTDIR))
-		free(file->name);
-	free(file);
+		arena_strfree(drv, file->name);
+	arena_file_release(drv, file);
 	return 0;
 }
 
+/* frees what a directory has allocated outside the drive's arena */
+void dir_free_tables(vdf_file *dir) {
+	if(dir->dir.index != NULL)
+		free(dir->dir.index);
+	if(dir->dir.blob != NULL)
+		free(dir->dir.blob);
+	free(dir->dir.name_tab);
+	tail_families_free(dir);
+}
+
+/* bytes allocated for the directory outside the drive's arena, see vdf_get_drive_footprint() */
+size_t dir_footprint(vdf_file *dir) {
+	vdf_tail_family *fam;
+	size_t n;
+	int i;
+
+	n = sizeof(vdf_file*) * (dir->dir.index_size + (dir->dir.tab_size * 2) + dir->dir.fam_size);
+	if(dir->dir.blob != NULL)
+		n += dir->dir.blob_len;
+	for(i=0; i<dir->dir.fam_size; i++) {
+		for(fam=dir->dir.fam_tab[i]; fam != NULL; fam=fam->next)
+			n += sizeof(vdf_tail_family) + (sizeof(int) * fam->free_size);
+	}
+	return n;
+}
+
 LIBFUNC int vdf_delete_file(vdf_file *file) {
 	if(!file_is_valid(file)) {
 		errno = EINVAL;
@@ -355,7 +780,13 @@ LIBFUNC int vdf_delete_file(vdf_file *file) {
 		errno = EPERM;
 		return -1;
 	}
+	tail_release(file);
+	hash_del_name(file);
+	hash_del_short(file);
 	list_del(&file->dirlist);
+	file->parent->dir.cnt--;
+	dir_set_dirty(file->parent, VFF_RECOUNT);
+	pathcache_flush(file->drv);
 	set_drive_dirty(file->drv);
 	return delete_file(file);
 }
@@ -383,32 +814,68 @@ LIBFUNC int vdf_move_file(vdf_file *file, vdf_file *new_parent) {
 		errno = EEXIST;
 		return -1;
 	}
+	hash_del_name(file);
+	hash_del_short(file);
 	list_del(&file->dirlist);
 	file->parent->dir.cnt--;
+	dir_set_dirty(file->parent, VFF_RECOUNT);
+	dir_hash_reserve(new_parent, new_parent->dir.cnt + 1);
 	list_add(&file->dirlist, &new_parent->dir.entries);
 	new_parent->dir.cnt++;
 	file->parent = new_parent;
+	pathcache_flush(file->drv);
+	hash_add_name(file);
+	hash_add_short(file);
+	/* calc_shortname() recounts the new parent, and a directory's '..' has changed */
+	if(vdf_file_is_dir(file))
+		dir_set_dirty(file, VFF_REENCODE);
 	set_drive_dirty(file->drv);
 	return calc_shortname(file);
 }
 
-static vdf_file *find_file_skip(vdf_file *dir, const char *name, int flags, vdf_file *skip) {
+/* look up the first 'len' characters of 'name' */
+static vdf_file *find_file_n(vdf_file *dir, const char *name, size_t len, int flags, vdf_file *skip) {
 	vdf_file *fil;
+	uint32_t h, b;
+
+	if(len == 0)
+		return NULL;
+	if(dir->dir.name_tab != NULL) {
+		h = name_hash_n(name, len);
+		b = h & (dir->dir.tab_size - 1);
+		if(!(flags & VFF_SHORTONLY)) {
+			for(fil=dir->dir.name_tab[b]; fil != NULL; fil=fil->name_next) {
+				if((fil != skip) && (fil->name_hash == h) && name_equal_n(name, len, fil->name))
+					return fil;
+			}
+		}
+		if(!(flags & VFF_LONGONLY)) {
+			for(fil=dir->dir.short_tab[b]; fil != NULL; fil=fil->short_next) {
+				if((fil != skip) && (fil->short_hash == h) && name_equal_n(name, len, fil->shortname))
+					return fil;
+			}
+		}
+		return NULL;
+	}
 	list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
 		if(fil == skip)
 			continue;
 		if(!(flags & VFF_SHORTONLY)) {
-			if(!strcasecmp(name, fil->name))
+			if(name_equal_n(name, len, fil->name))
 				return fil;
 		}
 		if(!(flags & VFF_LONGONLY)) {
-			if(!strcasecmp(name, fil->shortname))
+			if(name_equal_n(name, len, fil->shortname))
 				return fil;
 		}
 	}
 	return NULL;
 }
 
+static vdf_file *find_file_skip(vdf_file *dir, const char *name, int flags, vdf_file *skip) {
+	return find_file_n(dir, name, strlen(name), flags, skip);
+}
+
 LIBFUNC vdf_file *vdf_find_file(vdf_file *dir, const char *name, int flags) {
 	return vdf_find_file_skip(dir, name, flags, NULL);
 }
@@ -422,34 +889,37 @@ LIBFUNC vdf_file *vdf_find_file_skip(vdf_file *dir, const char *name, int flags,
 }
 
 static vdf_file *find_path(vdf_file *dir, const char *path, int flags) {
-	char *p;
 	const char *d;
-	vdf_file *fil;
-	int l;
-	for(d=path; *d; d++) {
-		if((*d == '/') || (*d == '\\'))
-			break;
+	vdf_file *fil = dir;
+
+	for(;;) {
+		for(d=path; (*d != 0) && (*d != '/') && (*d != '\\'); d++)
+			;
+		fil = find_file_n(fil, path, d - path, flags, NULL);
+		if((fil == NULL) || (*d == 0))
+			return fil;
+		if(!vdf_file_is_dir(fil))
+			return NULL;
+		path = d + 1;
 	}
-	if(*d == 0)
-		return find_file_skip(dir, path, flags, NULL);
-	l = d - path;
-	p = alloca(l + 1);
-	memcpy(p, path, l);
-	p[l] = 0;
-	fil = find_file_skip(dir, p, flags, NULL);
-	if(fil == NULL)
-		return NULL;
-	if(!vdf_file_is_dir(fil))
-		return NULL;
-	return find_path(fil, d + 1, flags);
 }
 
 LIBFUNC vdf_file *vdf_find_path(vdf_file *dir, const char *path, int flags) {
-	if(!file_is_valid(dir) || !vdf_file_is_dir(dir)) {
+	vdf_file *fil;
+	if(!file_is_valid(dir) || !vdf_file_is_dir(dir) || (path == NULL)) {
 		errno = EINVAL;
 		return NULL;
 	}
-	return find_path(dir, path, flags);
+	/* a single name is just one hash lookup, which is no slower than the cache */
+	if(path[strcspn(path, "/\\")] == 0)
+		return find_path(dir, path, flags);
+	fil = pathcache_find(dir->drv, dir, path, flags);
+	if(fil != NULL)
+		return fil;
+	fil = find_path(dir, path, flags);
+	if(fil != NULL)
+		pathcache_add(dir->drv, dir, path, flags, fil);
+	return fil;
 }
 
 LIBFUNC vdf_file *vdf_parent_dir(vdf_file *file) {
@@ -477,15 +947,18 @@ LIBFUNC int vdf_dir_count(vdf_file *dir) {
 }
 
 LIBFUNC vdf_file *vdf_dir_entry(vdf_file *dir, int index) {
-	vdf_file *fil;
+	vdf_file *fil, **ind;
 	if(!file_is_valid(dir) || !vdf_file_is_dir(dir) || (dir->parent == NULL)) {
 		errno = EINVAL;
 		return NULL;
 	}
-	if(index >= dir->dir.cnt) {
+	if((index < 0) || (index >= dir->dir.cnt)) {
 		errno = ERANGE;
 		return NULL;
 	}
+	ind = dir_index_get(dir);
+	if(ind != NULL)
+		return ind[index];
 	list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
 		if(index-- == 0)
 			return fil;
@@ -502,6 +975,8 @@ LIBFUNC int vdf_get_file_index(vdf_file *file) {
 		return -1;
 	}
 	dir = file->parent;
+	if(dir_index_get(dir) != NULL)
+		return file->dir_ind;
 	ind = 0;
 	list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
 		if(fil == file)
@@ -532,6 +1007,7 @@ LIBFUNC int vdf_file_up(vdf_file *file) {
 	p->next = file->dirlist.next;
 	file->dirlist.prev = tp;
 	file->dirlist.next = tn;
+	dir_set_dirty(file->parent, VFF_RECOUNT);
 	set_drive_dirty(file->drv);
 	return 0;
 }
@@ -557,6 +1033,7 @@ LIBFUNC int vdf_file_down(vdf_file *file) {
 	p->next = file->dirlist.next;
 	file->dirlist.prev = tp;
 	file->dirlist.next = tn;
+	dir_set_dirty(file->parent, VFF_RECOUNT);
 	set_drive_dirty(file->drv);
 	return 0;
 }
@@ -637,13 +1114,14 @@ LIBFUNC int vdf_set_file_name(vdf_file *file, const char *name) {
 		errno = EEXIST;
 		return -1;
 	}
-	n = strdup(name);
-	if(n == NULL) {
-		errno = ENOMEM;
+	n = arena_strdup(file->drv, name);
+	if(n == NULL)
 		return -1;
-	}
-	free(file->name);
+	hash_del_name(file);
+	arena_strfree(file->drv, file->name);
 	file->name = n;
+	hash_add_name(file);
+	pathcache_flush(file->drv);
 	calc_shortname(file);
 	set_drive_dirty(file->drv);
 	return 0;
@@ -693,9 +1171,15 @@ LIBFUNC int vdf_set_file_shortname(vdf_file *file, const char *name) {
 	if(!strcmp(file->name, name))
 #endif
 		file->flags &= ~VFF_LONGNAME;
+	tail_release(file);
+	hash_del_short(file);
 	for(n=file->shortname; *name != 0; name++, n++)
 		*n = toupper(*name);
 	*n = 0;
+	hash_add_short(file);
+	encode_shortname(file);
+	pathcache_flush(file->drv);
+	dir_set_dirty(file->parent, VFF_RECOUNT);
 	set_drive_dirty(file->drv);
 	return 0;
 }
@@ -729,10 +1213,12 @@ LIBFUNC int vdf_set_file_size(vdf_file *file, filesz_t size) {
 		errno = EPERM;
 		return -1;
 	}
+	file_relayout(file);
 	file->size = size;
 	size += file->drv->bpc - 1;
 	size /= file->drv->bpc;
 	file->clusters = size;
+	file_entry_changed(file);
 	set_drive_dirty(file->drv);
 	return 0;
 }
@@ -770,6 +1256,9 @@ LIBFUNC int vdf_set_fat_file_size(vdf_file *file, sfilesz_t size) {
 		size /= file->drv->bpc;
 		file->fatclusters = size;
 	}
+	/* the end of the FAT chain is worked out when the file is laid out */
+	file_relayout(file);
+	file_entry_changed(file);
 	set_drive_dirty(file->drv);
 	return 0;
 }
@@ -792,6 +1281,8 @@ LIBFUNC int vdf_set_file_date(vdf_file *file, time_t date) {
 		return -1;
 	}
 	file->date = date;
+	encode_date(file);
+	file_entry_changed(file);
 	set_drive_dirty(file->drv);
 	return 0;
 }
@@ -817,6 +1308,7 @@ LIBFUNC int vdf_set_file_attr(vdf_file *file, int attr, int mask) {
 	attr &= mask;
 	file->attr &= ~mask;
 	file->attr |= attr;
+	file_entry_changed(file);
 	set_drive_dirty(file->drv);
 	return file->attr;
 }
@@ -837,7 +1329,67 @@ int fents_needed(vdf_file *fil) {
 	return (strlen(fil->name) / 13) + 1;
 }
 
-int dir_recalc(vdf_file *dir) {
+/*
+	Changes are tracked per directory, so that recalculating the drive only has to redo
+	the directories that changed. VFF_RECOUNT means the entries were added, removed,
+	renamed or reordered: the entries are counted again (which may resize the directory)
+	and the index is rebuilt. VFF_REENCODE means only what is in the entries changed, eg.
+	a date or a start cluster, so just the encoded directory is out of date.
+*/
+void dir_set_dirty(vdf_file *dir, int what) {
+	if(!(dir->flags & (VFF_RECOUNT | VFF_REENCODE)))
+		list_add_tail(&dir->dir.dirty, &dir->drv->dirty_dirs);
+	if(what & VFF_RECOUNT)
+		what |= VFF_REENCODE | VFF_REINDEX;
+	dir->flags |= what;
+}
+
+/* the file's entry changed, so re-encode the directories it appears in (a directory is also '.' and its subdirectories' '..') */
+void file_entry_changed(vdf_file *file) {
+	vdf_file *fil;
+
+	if(file->parent != NULL)
+		dir_set_dirty(file->parent, VFF_REENCODE);
+	if(!vdf_file_is_dir(file))
+		return;
+	dir_set_dirty(file, VFF_REENCODE);
+	list_foreach_item(vdf_file, fil, &file->dir.entries, dirlist) {
+		if(vdf_file_is_dir(fil))
+			dir_set_dirty(fil, VFF_REENCODE);
+	}
+}
+
+/*
+	The file's clusters are about to change, so everything from its range on has to be
+	laid out again. Files created since the last recalculation are laid out anyway. A
+	file that was empty had no range, so it is laid out from the next file that had one.
+*/
+void file_relayout(vdf_file *file) {
+	vdf_drive *drv = file->drv;
+	vdf_file *fil;
+	int ind;
+
+	if(file->seq >= drv->recalc_seq)
+		return;
+	ind = file->range_ind;
+	if(ind == -1) {
+		ind = drv->range_cnt;
+		fil = list_item(file->alllist.next, vdf_file, alllist);
+		list_foreach_item_from(vdf_file, fil, &drv->all_files, alllist) {
+			if(fil->seq >= drv->recalc_seq)
+				break;
+			if(fil->range_ind != -1) {
+				ind = fil->range_ind;
+				break;
+			}
+		}
+	}
+	if(ind < drv->relayout)
+		drv->relayout = ind;
+}
+
+/* count the directory's entries again and work out its size. directories below it are left alone */
+void dir_recount(vdf_file *dir) {
 	vdf_file *fil;
 	int c;
 
@@ -850,25 +1402,67 @@ int dir_recalc(vdf_file *dir) {
 		c = 2;			/* '.' and '..' */
 	dir->dir.fent_cnt = c;
 	list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
-		if(vdf_file_is_dir(fil)) {
-			if(dir_recalc(fil) == -1)
-				return -1;
-		} else {
-			if(file_recalc_dir(fil) == -1)
-				return -1;
-		}
+		file_recalc_dir(fil);
 	}
 	dir->size = dir->dir.fent_cnt * 32;
 	dir->clusters = dir->size;
 	dir->clusters += dir->drv->bpc - 1;
 	dir->clusters /= dir->drv->bpc;
-	if((dir->parent != NULL) || (dir->drv->filesys == VDF_FAT32)) {
-		if(file_recalc_dir(dir) == -1)
+}
+
+/*
+	A directory's index is an array of its entries in list order, so management calls can
+	find an entry by position (and a file's position) and read_sector_dir() can binary
+	search for a directory entry number instead of walking the list. Anything that adds,
+	removes or reorders entries marks the directory VFF_REINDEX. The indexes are rebuilt
+	for the directories that changed when the drive is recalculated, and on demand by the
+	management calls while it is unlocked.
+*/
+int dir_index_build(vdf_file *dir) {
+	vdf_file *fil, **ind;
+	int i;
+
+	if((dir->dir.index == NULL) || (dir->dir.index_size < dir->dir.cnt)) {
+		i = dir->dir.cnt ? dir->dir.cnt : 1;
+		ind = realloc(dir->dir.index, sizeof(vdf_file*) * i);
+		if(ind == NULL) {
+			errno = ENOMEM;
 			return -1;
+		}
+		dir->dir.index = ind;
+		dir->dir.index_size = i;
+	}
+	i = 0;
+	list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
+		fil->dir_ind = i;
+		dir->dir.index[i++] = fil;
 	}
+	dir->flags &= ~VFF_REINDEX;
 	return 0;
 }
 
+/* the directory's index, rebuilding it if needed. NULL if there isn't enough memory for it */
+vdf_file **dir_index_get(vdf_file *dir) {
+	if(!dir_index_valid(dir) && (dir_index_build(dir) == -1))
+		return NULL;
+	return dir->dir.index;
+}
+
+/* the entry that directory entry 'ent' belongs to, or the first one if 'ent' comes before it */
+vdf_file *dir_index_find(vdf_file *dir, int ent) {
+	vdf_file **ind = dir->dir.index;
+	int lo = 0, hi = dir->dir.cnt - 1, mid;
+
+	while(lo < hi) {
+		mid = lo + ((hi - lo + 1) / 2);
+		if(ind[mid]->fent_start <= ent)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return ind[lo];
+}
+
 int file_recalc_dir(vdf_file *file) {
 	if(file->parent != NULL) {
 		file->fent_start = file->parent->dir.fent_cnt;
@@ -878,9 +1472,16 @@ int file_recalc_dir(vdf_file *file) {
 	return 0;
 }
 
+/* the drive's cluster size changed */
+void file_recalc_clusters(vdf_file *file) {
+	size_t bpc = file->drv->bpc;
+	file->clusters = (file->size + bpc - 1) / bpc;
+	if(file->fatclusters != -1)
+		file->fatclusters = (file->fatsize + bpc - 1) / bpc;
+}
+
 int file_recalc_offsize(vdf_file *file) {
 	if(file->size != 0) {
-		file->drv->nonempty_file_cnt++;
 		file->start = file->drv->data_cluster_end;
 		if(file->fatclusters != -1)
 			file->data_end = file->start + file->fatclusters;
@@ -888,12 +1489,16 @@ int file_recalc_offsize(vdf_file *file) {
 		file->end = file->drv->data_cluster_end;
 		if(file->fatclusters == -1)
 			file->data_end = file->end;
-		if(file->drv->data_end >= file->drv->sectors)
+		if(file->drv->data_end >= file->drv->sectors) {
+			errno = ENOSPC;
 			return -1;
+		}
 		file->startsect = file->drv->data_end;
 		file->drv->data_end += file->clusters * file->drv->spc;
-		if(file->drv->data_end >= file->drv->sectors)
+		if(file->drv->data_end >= file->drv->sectors) {
+			errno = ENOSPC;
 			return -1;
+		}
 		file->endsect = file->drv->data_end;
 	} else {
 		file->start = 0;
@@ -0,0 +1,519 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR) && defined(HAVE_FNMATCH)
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define USE_IMPORT
+#endif
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+#include "vdf_thread.h"
+
+/*
+	vdf_import_tree() works in two steps. First a pool of threads reads the host tree:
+	each takes a directory off a shared queue, reads it with fstatat() relative to the
+	directory's descriptor and queues the directories it finds. Subdirectories are opened
+	with openat() while the directory is still open, as long as there aren't too many
+	descriptors held by queued directories already, and by path otherwise. Nothing on the
+	drive is touched during this, so a tree that can't be read leaves the drive as it was.
+
+	Then the calling thread adds everything in one go, a directory at a time. The name
+	tables are sized for the whole directory up front, and entries are added in name order
+	with the names that are their own short name first, so a generated short name can
+	never take the name of a file that comes later in the same directory.
+*/
+
+#ifdef USE_IMPORT
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY			0
+#endif
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW			0
+#endif
+
+#define IMPORT_THREADS_MAX	64					/* most threads reading the host tree */
+#define IMPORT_FDS_MAX		256					/* most descriptors held by queued directories */
+
+typedef struct _imp_dir imp_dir;
+
+typedef struct _imp_ent {
+	char			*name;
+	imp_dir			*dir;						/* contents if this is a directory, otherwise NULL */
+	vdf_file		*file;						/* directory added for it, see build_dir() */
+	filesz_t		size;
+	time_t			date;
+} imp_ent;
+
+struct _imp_dir {
+	imp_dir			*parent;
+	imp_dir			*qnext;						/* work queue link */
+	char			*path;						/* host path */
+	int				fd;							/* opened by the parent's reader or -1 */
+	dev_t			dev;						/* to spot symbolic link loops */
+	ino_t			ino;
+	imp_ent			*ents;						/* entries in name order */
+	int				cnt;
+	int				size;						/* number of entries allocated */
+	char			*names;						/* every entry's name, one after the other */
+	size_t			names_len;
+	size_t			names_size;
+	int				skipped;					/* entries left out: too big for FAT or not readable */
+	int				unreadable;					/* couldn't be opened or listed, left out */
+};
+
+typedef struct _imp_walk {
+	vdf_mutex		lock;
+	vdf_cond		cond;
+	imp_dir			*queue;						/* directories waiting to be read */
+	int				pending;					/* directories queued or being read */
+	int				fds;						/* descriptors held by queued directories */
+	int				err;						/* first error or 0 */
+	const vdf_import_opts *opts;
+} imp_walk;
+
+static int name_matches(const char **pats, const char *name) {
+	for(; *pats != NULL; pats++) {
+		if(fnmatch(*pats, name, 0) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static imp_dir *dir_new(imp_dir *parent, const char *path, size_t path_len, const char *name) {
+	imp_dir *d = malloc(sizeof(imp_dir));
+	size_t len;
+
+	if(d == NULL)
+		return NULL;
+	memset(d, 0, sizeof(imp_dir));
+	len = (name != NULL) ? strlen(name) : 0;
+	d->path = malloc(path_len + len + 2);
+	if(d->path == NULL) {
+		free(d);
+		return NULL;
+	}
+	memcpy(d->path, path, path_len);
+	if(name != NULL) {
+		/* only the root of the host filesystem ends in one already */
+		if((path_len == 0) || (path[path_len - 1] != '/'))
+			d->path[path_len++] = '/';
+		memcpy(d->path + path_len, name, len);
+	}
+	d->path[path_len + len] = 0;
+	d->parent = parent;
+	d->fd = -1;
+	return d;
+}
+
+static void dir_free(imp_dir *d) {
+	int i;
+	for(i=0; i<d->cnt; i++) {
+		if(d->ents[i].dir != NULL)
+			dir_free(d->ents[i].dir);
+	}
+	if(d->fd != -1)
+		close(d->fd);
+	free(d->ents);
+	free(d->names);
+	free(d->path);
+	free(d);
+}
+
+static int ent_add(imp_dir *d, const char *name, struct stat *st) {
+	size_t len = strlen(name) + 1;
+	imp_ent *e;
+	char *n;
+	int size;
+
+	if(d->cnt == d->size) {
+		size = d->size ? d->size * 2 : 16;
+		e = realloc(d->ents, sizeof(imp_ent) * size);
+		if(e == NULL)
+			return ENOMEM;
+		d->ents = e;
+		d->size = size;
+	}
+	if((d->names_len + len) > d->names_size) {
+		d->names_size = d->names_size ? d->names_size * 2 : 512;
+		while(d->names_size < (d->names_len + len))
+			d->names_size *= 2;
+		n = realloc(d->names, d->names_size);
+		if(n == NULL)
+			return ENOMEM;
+		d->names = n;
+	}
+	memcpy(d->names + d->names_len, name, len);
+	e = d->ents + d->cnt++;
+	/* an offset for now, 'names' can still move */
+	e->name = (char*)(uintptr_t)d->names_len;
+	e->dir = NULL;
+	e->file = NULL;
+	e->size = S_ISDIR(st->st_mode) ? 0 : (filesz_t)st->st_size;
+	e->date = st->st_ctime;
+	d->names_len += len;
+	return 0;
+}
+
+static int ent_cmp(const void *a, const void *b) {
+	return strcmp(((const imp_ent*)a)->name, ((const imp_ent*)b)->name);
+}
+
+/* the directory loops back to itself through a symbolic link */
+static int dir_is_loop(imp_dir *d, struct stat *st) {
+	for(; d != NULL; d=d->parent) {
+		if((d->dev == st->st_dev) && (d->ino == st->st_ino))
+			return 1;
+	}
+	return 0;
+}
+
+/* a directory that can't be read (eg. EACCES) is left out of the import rather than failing
+   it, unless it is the one being imported or there's no memory */
+static int dir_unreadable(imp_dir *d, int err) {
+	if((err == ENOMEM) || (d->parent == NULL))
+		return err;
+	d->unreadable = 1;
+	return 0;
+}
+
+/* read one directory. returns 0 or an errno value */
+static int read_dir(imp_walk *w, imp_dir *d) {
+	const vdf_import_opts *opts = w->opts;
+	int follow = opts->flags & VIF_FOLLOW;
+	size_t path_len = strlen(d->path);
+	struct dirent *de;
+	struct stat st;
+	imp_dir *sub;
+	DIR *dir;
+	int fd, err = 0, i;
+
+	fd = d->fd;
+	if(fd == -1) {
+		fd = open(d->path, O_RDONLY | O_DIRECTORY);
+		if(fd == -1)
+			return dir_unreadable(d, errno);
+	} else {
+		mutex_lock(&w->lock);
+		w->fds--;
+		mutex_unlock(&w->lock);
+	}
+	d->fd = -1;
+	dir = fdopendir(fd);
+	if(dir == NULL) {
+		err = errno;
+		close(fd);
+		return dir_unreadable(d, err);
+	}
+	while((de = readdir(dir)) != NULL) {
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if((opts->exclude != NULL) && name_matches(opts->exclude, de->d_name))
+			continue;
+		if(fstatat(fd, de->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == -1) {
+			/* gone since it was listed */
+			if(errno == ENOENT)
+				continue;
+			if(errno == ENOMEM) {
+				err = errno;
+				break;
+			}
+			d->skipped++;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			if(follow && dir_is_loop(d, &st))
+				continue;
+		} else if(S_ISREG(st.st_mode)) {
+			if((opts->include != NULL) && !name_matches(opts->include, de->d_name))
+				continue;
+			if((uint64_t)st.st_size > (filesz_t)~0) {
+				d->skipped++;
+				continue;
+			}
+		} else {
+			continue;
+		}
+		err = ent_add(d, de->d_name, &st);
+		if(err != 0)
+			break;
+		if(S_ISDIR(st.st_mode)) {
+			sub = dir_new(d, d->path, path_len, de->d_name);
+			if(sub == NULL) {
+				err = ENOMEM;
+				break;
+			}
+			d->ents[d->cnt - 1].dir = sub;
+			sub->dev = st.st_dev;
+			sub->ino = st.st_ino;
+			mutex_lock(&w->lock);
+			i = w->fds < IMPORT_FDS_MAX;
+			if(i)
+				w->fds++;
+			mutex_unlock(&w->lock);
+			if(i) {
+				sub->fd = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY | (follow ? 0 : O_NOFOLLOW));
+				if(sub->fd == -1) {
+					mutex_lock(&w->lock);
+					w->fds--;
+					mutex_unlock(&w->lock);
+				}
+			}
+		}
+	}
+	closedir(dir);
+	if(err != 0)
+		return err;
+	for(i=0; i<d->cnt; i++)
+		d->ents[i].name = d->names + (uintptr_t)d->ents[i].name;
+	if(d->cnt > 1)
+		qsort(d->ents, d->cnt, sizeof(imp_ent), ent_cmp);
+	return 0;
+}
+
+static void walk_run(imp_walk *w) {
+	imp_dir *d;
+	int err, i, n;
+
+	mutex_lock(&w->lock);
+	while(1) {
+		while((w->queue == NULL) && (w->pending != 0) && (w->err == 0))
+			cond_wait(&w->cond, &w->lock);
+		if((w->pending == 0) || (w->err != 0))
+			break;
+		d = w->queue;
+		w->queue = d->qnext;
+		mutex_unlock(&w->lock);
+		err = read_dir(w, d);
+		mutex_lock(&w->lock);
+		if(err != 0) {
+			if(w->err == 0)
+				w->err = err;
+			break;
+		}
+		n = 0;
+		for(i=d->cnt - 1; i>=0; i--) {
+			if(d->ents[i].dir != NULL) {
+				d->ents[i].dir->qnext = w->queue;
+				w->queue = d->ents[i].dir;
+				n++;
+			}
+		}
+		w->pending += n - 1;
+		if((n > 1) || (w->pending == 0))
+			cond_broadcast(&w->cond);
+	}
+	cond_broadcast(&w->cond);
+	mutex_unlock(&w->lock);
+}
+
+static void *walk_thread(void *arg) {
+	walk_run(arg);
+	return NULL;
+}
+
+static int walk_threads(const vdf_import_opts *opts) {
+	long n = opts->threads;
+#ifdef _SC_NPROCESSORS_ONLN
+	if(n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(n <= 0)
+		n = 1;
+	return (n > IMPORT_THREADS_MAX) ? IMPORT_THREADS_MAX : (int)n;
+}
+
+/* read the whole tree below 'root'. returns 0 or an errno value */
+static int walk_tree(imp_dir *root, const vdf_import_opts *opts) {
+	pthread_t threads[IMPORT_THREADS_MAX];
+	imp_walk w;
+	int i, cnt;
+
+	memset(&w, 0, sizeof(w));
+	mutex_init(&w.lock);
+	cond_init(&w.cond);
+	w.opts = opts;
+	w.queue = root;
+	w.pending = 1;
+	w.fds = 1;									/* the root's, given back when it is read */
+
+	/* the calling thread is one of them */
+	cnt = walk_threads(opts) - 1;
+	for(i=0; i<cnt; i++) {
+		if(pthread_create(threads + i, NULL, walk_thread, &w) != 0)
+			break;
+	}
+	cnt = i;
+	walk_run(&w);
+	for(i=0; i<cnt; i++)
+		pthread_join(threads[i], NULL);
+
+	cond_destroy(&w.cond);
+	mutex_destroy(&w.lock);
+	return w.err;
+}
+
+typedef struct _imp_build {
+	const vdf_import_opts *opts;
+	char			*path;						/* host path of the file being added */
+	size_t			path_size;
+	int				files, dirs, skipped;
+} imp_build;
+
+static vdf_file *add_real(imp_build *b, vdf_file *parent, imp_dir *d, imp_ent *e) {
+	size_t dlen = strlen(d->path), len = dlen + strlen(e->name) + 2;
+	char *p;
+
+	if(len > b->path_size) {
+		p = realloc(b->path, len);
+		if(p == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		b->path = p;
+		b->path_size = len;
+	}
+	memcpy(b->path, d->path, dlen);
+	if((dlen == 0) || (d->path[dlen - 1] != '/'))
+		b->path[dlen++] = '/';
+	strcpy(b->path + dlen, e->name);
+	return file_add_real(parent, e->name, b->path, e->size, e->date, b->opts->add_flags);
+}
+
+static int build_dir(imp_build *b, vdf_file *parent, imp_dir *d) {
+	vdf_file *fil;
+	imp_ent *e;
+	int pass, i;
+
+	b->skipped += d->skipped;
+	dir_hash_reserve(parent, parent->dir.cnt + d->cnt);
+	for(pass=0; pass<2; pass++) {
+		for(i=0, e=d->ents; i<d->cnt; i++, e++) {
+			if(name_is_short(e->name) != (pass == 0))
+				continue;
+			if((e->dir != NULL) && e->dir->unreadable) {
+				b->skipped++;
+				continue;
+			}
+			if(e->dir != NULL) {
+				fil = vdf_add_dir(parent, e->name);
+				if(fil != NULL)
+					vdf_set_file_date(fil, e->date);
+			} else {
+				fil = add_real(b, parent, d, e);
+			}
+			if(fil == NULL) {
+				/* a name FAT can't hold or one that only differs by case from another */
+				if((errno == EINVAL) || (errno == EEXIST)) {
+					b->skipped++;
+					continue;
+				}
+				return -1;
+			}
+			e->file = fil;
+			if(e->dir != NULL)
+				b->dirs++;
+			else
+				b->files++;
+		}
+	}
+	for(i=0, e=d->ents; i<d->cnt; i++, e++) {
+		if((e->dir != NULL) && (e->file != NULL) && (build_dir(b, e->file, e->dir) == -1))
+			return -1;
+	}
+	return 0;
+}
+
+#endif /* USE_IMPORT */
+
+LIBFUNC int vdf_import_tree(vdf_file *parent, const char *path, vdf_import_opts *opts) {
+#ifdef USE_IMPORT
+	vdf_import_opts defopts;
+	imp_build b;
+	imp_dir *root;
+	struct stat st;
+	size_t len;
+	int ret, err;
+
+	if(!vdf_file_is_dir(parent) || (path == NULL) || (*path == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(vdf_drive_is_locked(parent->drv)) {
+		errno = EPERM;
+		return -1;
+	}
+	if(opts == NULL) {
+		memset(&defopts, 0, sizeof(defopts));
+		opts = &defopts;
+	}
+	len = strlen(path);
+	while((len > 1) && (path[len - 1] == '/'))
+		len--;
+	root = dir_new(NULL, path, len, NULL);
+	if(root == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	root->fd = open(root->path, O_RDONLY | O_DIRECTORY);
+	if((root->fd == -1) || (fstat(root->fd, &st) == -1)) {
+		err = errno;
+		dir_free(root);
+		errno = err;
+		return -1;
+	}
+	root->dev = st.st_dev;
+	root->ino = st.st_ino;
+
+	err = walk_tree(root, opts);
+	if(err != 0) {
+		dir_free(root);
+		errno = err;
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.opts = opts;
+	ret = build_dir(&b, parent, root);
+	err = errno;
+	free(b.path);
+	dir_free(root);
+	opts->files = b.files;
+	opts->dirs = b.dirs;
+	opts->skipped = b.skipped;
+	errno = err;
+	return ret;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
@@ -87,6 +87,10 @@ static INLINE int list_empty_careful(const list_head *head) {
 		&pos->member != (head);												\
 		pos = list_item(pos->member.next, type, member))
 
+#define list_foreach_item_from(type, pos, head, member)						\
+	for(; &pos->member != (head);											\
+		pos = list_item(pos->member.next, type, member))
+
 #define list_foreach_item_rev(type, pos, head, member)						\
 	for(pos = list_item((head)->prev, type, member);						\
 		&pos->member != (head);												\
@@ -0,0 +1,236 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_read.h"
+#include "vdf_metacache.h"
+
+/* Boot, FAT and directory sectors can't change while the drive is locked, but clients
+   re-read the FAT and directories all the time. Generated sectors are kept on a LRU list
+   (and in a hash table keyed by partition sector) until they would take more than mc_max
+   bytes. Everything is thrown away when the drive's epoch changes. */
+
+typedef struct _vdf_metasect {
+	struct _vdf_metasect *next;					/* next sector in the hash bucket */
+	list_head		lru;
+	sector_t		sector;
+	uint8_t			data[1];					/* drv->bps bytes */
+} vdf_metasect;
+
+#define METASECT_SIZE(drv)		(offsetof(vdf_metasect, data) + (drv)->bps)
+
+void metacache_init(vdf_drive *drv) {
+	drv->mc_hash = NULL;
+	drv->mc_hash_mask = 0;
+	INIT_LIST_HEAD(&drv->mc_lru);
+	drv->mc_cnt = 0;
+	drv->mc_max = DEFAULT_META_CACHE_SIZE;
+	drv->mc_epoch = drv->epoch;
+	drv->mc_hits = drv->mc_misses = 0;
+	mutex_init(&drv->mc_lock);
+}
+
+static void flush(vdf_drive *drv) {
+	vdf_metasect *ms, *ms_n;
+	list_foreach_item_safe(vdf_metasect, ms, ms_n, &drv->mc_lru, lru) {
+		free(ms);
+	}
+	INIT_LIST_HEAD(&drv->mc_lru);
+	drv->mc_cnt = 0;
+	if(drv->mc_hash != NULL) {
+		free(drv->mc_hash);
+		drv->mc_hash = NULL;
+	}
+	drv->mc_epoch = drv->epoch;
+}
+
+void metacache_free(vdf_drive *drv) {
+	flush(drv);
+	mutex_destroy(&drv->mc_lock);
+}
+
+void metacache_flush(vdf_drive *drv) {
+	mutex_lock(&drv->mc_lock);
+	if(drv->mc_cnt != 0)
+		flush(drv);
+	drv->mc_epoch = drv->epoch;
+	mutex_unlock(&drv->mc_lock);
+}
+
+static size_t max_sectors(vdf_drive *drv) {
+	return drv->mc_max / METASECT_SIZE(drv);
+}
+
+static vdf_metasect *lookup(vdf_drive *drv, sector_t sector) {
+	vdf_metasect *ms;
+
+	if(drv->mc_hash == NULL)
+		return NULL;
+	for(ms = drv->mc_hash[sector & drv->mc_hash_mask]; ms != NULL; ms = ms->next) {
+		if(ms->sector == sector)
+			return ms;
+	}
+	return NULL;
+}
+
+static void unhash(vdf_drive *drv, vdf_metasect *ms) {
+	vdf_metasect **p;
+	for(p = &drv->mc_hash[ms->sector & drv->mc_hash_mask]; *p != ms; p = &(*p)->next)
+		;
+	*p = ms->next;
+}
+
+static void evict(vdf_drive *drv, size_t max) {
+	vdf_metasect *ms, *ms_n;
+	list_foreach_item_rev_safe(vdf_metasect, ms, ms_n, &drv->mc_lru, lru) {
+		if(drv->mc_cnt <= max)
+			break;
+		unhash(drv, ms);
+		list_del(&ms->lru);
+		free(ms);
+		drv->mc_cnt--;
+	}
+}
+
+static void insert(vdf_drive *drv, sector_t sector, const uint8_t *data) {
+	vdf_metasect *ms;
+	size_t max = max_sectors(drv);
+	unsigned int buckets;
+
+	if((max == 0) || (lookup(drv, sector) != NULL))
+		return;
+	if(drv->mc_hash == NULL) {
+		/* metadata sectors are mostly consecutive, so the low bits of the sector spread them well */
+		for(buckets = 16; (buckets < max) && (buckets < 0x100000); buckets <<= 1)
+			;
+		drv->mc_hash = calloc(buckets, sizeof(vdf_metasect*));
+		if(drv->mc_hash == NULL)
+			return;
+		drv->mc_hash_mask = buckets - 1;
+	}
+	if(drv->mc_cnt >= max) {
+		/* reuse the least recently used sector */
+		ms = list_item(drv->mc_lru.prev, vdf_metasect, lru);
+		unhash(drv, ms);
+		list_del(&ms->lru);
+		drv->mc_cnt--;
+	} else {
+		ms = malloc(METASECT_SIZE(drv));
+		if(ms == NULL)
+			return;
+	}
+	ms->sector = sector;
+	memcpy(ms->data, data, drv->bps);
+	ms->next = drv->mc_hash[sector & drv->mc_hash_mask];
+	drv->mc_hash[sector & drv->mc_hash_mask] = ms;
+	list_add(&ms->lru, &drv->mc_lru);
+	drv->mc_cnt++;
+}
+
+int metacache_read(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buffer, meta_fill_func fill, void *arg) {
+	vdf_drive *drv = ctx->drv;
+	vdf_metasect *ms;
+	unsigned int epoch;
+	sectcnt_t run, i;
+
+	if(drv->mc_max == 0)
+		return fill(ctx, sector, cnt, buffer, arg);
+	while(cnt != 0) {
+		mutex_lock(&drv->mc_lock);
+		if(drv->mc_epoch != drv->epoch)
+			flush(drv);
+		for(; (cnt != 0) && ((ms = lookup(drv, sector)) != NULL); sector++, cnt--) {
+			memcpy(buffer, ms->data, drv->bps);
+			list_del(&ms->lru);
+			list_add(&ms->lru, &drv->mc_lru);
+			drv->mc_hits++;
+			buffer += drv->bps;
+		}
+		if(cnt == 0) {
+			mutex_unlock(&drv->mc_lock);
+			break;
+		}
+		/* generate everything up to the next cached sector in one go */
+		for(run = 1; (run < cnt) && (lookup(drv, sector + run) == NULL); run++)
+			;
+		drv->mc_misses += run;
+		epoch = drv->epoch;
+		mutex_unlock(&drv->mc_lock);
+
+		if(fill(ctx, sector, run, buffer, arg) == -1)
+			return -1;
+
+		mutex_lock(&drv->mc_lock);
+		if(epoch == drv->mc_epoch) {
+			for(i=0; i<run; i++)
+				insert(drv, sector + i, buffer + (i * drv->bps));
+		}
+		mutex_unlock(&drv->mc_lock);
+		sector += run;
+		cnt -= run;
+		buffer += run * drv->bps;
+	}
+	return 0;
+}
+
+LIBFUNC int vdf_set_drive_meta_cache(vdf_drive *drv, size_t max_bytes) {
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	mutex_lock(&drv->mc_lock);
+	drv->mc_max = max_bytes;
+	if(max_sectors(drv) == 0)
+		flush(drv);
+	else
+		evict(drv, max_sectors(drv));
+	mutex_unlock(&drv->mc_lock);
+	return 0;
+}
+
+LIBFUNC ssize_t vdf_get_drive_meta_cache(vdf_drive *drv) {
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return drv->mc_max;
+}
+
+LIBFUNC int vdf_get_drive_meta_cache_stats(vdf_drive *drv, uint64_t *hits, uint64_t *misses) {
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	mutex_lock(&drv->mc_lock);
+	if(hits != NULL)
+		*hits = drv->mc_hits;
+	if(misses != NULL)
+		*misses = drv->mc_misses;
+	mutex_unlock(&drv->mc_lock);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define USE_MMAP
+#endif
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+#include "vdf_fdcache.h"
+#include "vdf_mmap.h"
+#include "vdf_read.h"
+
+/* Real files added with VAF_MMAP (or all real files on a VDF_MMAP drive) are mapped when
+   the drive is locked, so that reads are served by memcpy() rather than a system call.
+   Files are mapped read-only and shared, so the page cache is shared with every other
+   reader of the file. The mapping is never longer than the file was when it was mapped;
+   anything past that reads as zeros, the same as a short read(). */
+
+#ifdef USE_MMAP
+static void file_map(vdf_file *file) {
+	struct stat st;
+	filesz_t len;
+	void *map;
+	int fd;
+
+	fd = fdcache_get(file);
+	if(fd == -1)
+		return;
+	if(fstat(fd, &st) == -1) {
+		fdcache_put(file, fd);
+		return;
+	}
+	len = file->size;
+	if((off_t)len > st.st_size)
+		len = st.st_size;
+	if(len != 0) {
+		map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		if(map != MAP_FAILED) {
+#if defined(HAVE_MADVISE) && defined(MADV_SEQUENTIAL)
+			madvise(map, len, MADV_SEQUENTIAL);
+#endif
+			file->real.map = map;
+			file->real.map_len = len;
+			file->drv->map_cnt++;
+			file->drv->ranges[file->range_ind].type = RDO_MEM;
+		}
+	}
+	/* failing to map isn't an error, reads just go through the descriptor instead */
+	fdcache_put(file, fd);
+}
+#endif
+
+void drive_map_files(vdf_drive *drv) {
+#ifdef USE_MMAP
+	vdf_file *fil;
+	/* don't walk every file of a big drive for nothing */
+	if(!(drv->flags & VDF_MMAP) && (drv->mmap_file_cnt == 0))
+		return;
+	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
+		if(vdf_file_is_dir(fil) || vdf_file_is_virt(fil) || (fil->size == 0))
+			continue;
+		if((drv->flags & VDF_MMAP) || (fil->flags & VFF_MMAP))
+			file_map(fil);
+	}
+#endif
+}
+
+void file_unmap(vdf_file *file) {
+#ifdef USE_MMAP
+	if(file->real.map != NULL) {
+		munmap(file->real.map, file->real.map_len);
+		file->drv->map_cnt--;
+		file->drv->ranges[file->range_ind].type = RDO_FILE;
+	}
+#endif
+	file->real.map = NULL;
+	file->real.map_len = 0;
+}
+
+void drive_unmap_files(vdf_drive *drv) {
+	vdf_file *fil;
+	if(drv->map_cnt == 0)
+		return;
+	list_foreach_item(vdf_file, fil, &drv->all_files, alllist) {
+		if(!vdf_file_is_dir(fil) && !vdf_file_is_virt(fil))
+			file_unmap(fil);
+	}
+}
@@ -0,0 +1,123 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_pathcache.h"
+
+/* Control programs tend to look the same few paths up over and over. Paths that resolved
+   are kept in a direct mapped table keyed by the directory the lookup started from, the
+   exact path string and the lookup flags. A path spelt differently (other case, '\'
+   instead of '/') just gets an entry of its own. Only renaming, moving and deleting can
+   make an entry wrong, and they flush the whole table by moving pc_epoch on. Failed
+   lookups aren't cached, since adding a file would make them wrong. */
+
+typedef struct _vdf_pathent {
+	vdf_file		*dir;						/* directory the lookup started from (NULL if unused) */
+	vdf_file		*file;						/* what the path resolved to */
+	char			*path;
+	size_t			path_size;					/* bytes allocated for 'path' */
+	uint32_t		hash;
+	int				flags;
+	unsigned int	epoch;						/* drv->pc_epoch when the entry was made */
+} vdf_pathent;
+
+static uint32_t path_hash(vdf_file *dir, const char *path, int flags) {
+	uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)dir ^ flags;
+	while(*path)
+		h = (h ^ (uint8_t)*path++) * 16777619u;
+	return h;
+}
+
+void pathcache_init(vdf_drive *drv) {
+	drv->pc_ents = NULL;
+	drv->pc_epoch = 0;
+	mutex_init(&drv->pc_lock);
+}
+
+void pathcache_free(vdf_drive *drv) {
+	int i;
+	if(drv->pc_ents != NULL) {
+		for(i=0; i<PATH_CACHE_SLOTS; i++)
+			free(drv->pc_ents[i].path);
+		free(drv->pc_ents);
+		drv->pc_ents = NULL;
+	}
+	mutex_destroy(&drv->pc_lock);
+}
+
+void pathcache_flush(vdf_drive *drv) {
+	mutex_lock(&drv->pc_lock);
+	drv->pc_epoch++;
+	mutex_unlock(&drv->pc_lock);
+}
+
+vdf_file *pathcache_find(vdf_drive *drv, vdf_file *dir, const char *path, int flags) {
+	vdf_pathent *pe;
+	vdf_file *file = NULL;
+	uint32_t h = path_hash(dir, path, flags);
+
+	mutex_lock(&drv->pc_lock);
+	if(drv->pc_ents != NULL) {
+		pe = &drv->pc_ents[h & (PATH_CACHE_SLOTS - 1)];
+		if((pe->dir == dir) && (pe->epoch == drv->pc_epoch) && (pe->hash == h) &&
+		   (pe->flags == flags) && !strcmp(pe->path, path))
+			file = pe->file;
+	}
+	mutex_unlock(&drv->pc_lock);
+	return file;
+}
+
+/* remember that 'path' from 'dir' resolved to 'file'. nothing is cached if there's no memory */
+void pathcache_add(vdf_drive *drv, vdf_file *dir, const char *path, int flags, vdf_file *file) {
+	vdf_pathent *pe;
+	uint32_t h = path_hash(dir, path, flags);
+	size_t l = strlen(path) + 1;
+	char *p;
+
+	mutex_lock(&drv->pc_lock);
+	if(drv->pc_ents == NULL) {
+		drv->pc_ents = calloc(PATH_CACHE_SLOTS, sizeof(vdf_pathent));
+		if(drv->pc_ents == NULL)
+			goto exit;
+	}
+	pe = &drv->pc_ents[h & (PATH_CACHE_SLOTS - 1)];
+	if(pe->path_size < l) {
+		p = realloc(pe->path, l);
+		if(p == NULL)
+			goto exit;
+		pe->path = p;
+		pe->path_size = l;
+	}
+	memcpy(pe->path, path, l);
+	pe->dir = dir;
+	pe->file = file;
+	pe->hash = h;
+	pe->flags = flags;
+	pe->epoch = drv->pc_epoch;
+exit:
+	mutex_unlock(&drv->pc_lock);
+}
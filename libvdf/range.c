@@ -0,0 +1,161 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+
+/*
+	Lookup index over drv->ranges.
+
+	The ranges are sorted by start sector and, as files are laid out back to back, their
+	end sectors and end FAT entries are sorted in the same order. Both are copied into
+	arrays in Eytzinger (breadth-first binary tree) order, so that a search touches the
+	same few cache lines at the top of the tree for every lookup and walks down without
+	any data dependent branches. 'rank' maps a tree position back to the range index.
+	Position 0 is unused so that the children of k are 2k and 2k+1.
+*/
+
+static int build(vdf_rangeindex *ind, vdf_filerange *ranges, int i, int k) {
+	if(k <= ind->cnt) {
+		i = build(ind, ranges, i, 2 * k);
+		ind->sectend[k] = ranges[i].sectend;
+		ind->fatend[k] = ranges[i].fatend;
+		ind->rank[k] = i;
+		i = build(ind, ranges, i + 1, (2 * k) + 1);
+	}
+	return i;
+}
+
+void range_index_free(vdf_rangeindex *ind) {
+	if(ind->sectend != NULL)
+		free(ind->sectend);
+	if(ind->fatend != NULL)
+		free(ind->fatend);
+	if(ind->rank != NULL)
+		free(ind->rank);
+	memset(ind, 0, sizeof(vdf_rangeindex));
+}
+
+/* the arrays are kept between recalculations, with some room for files added in the meantime */
+int range_index_build(vdf_drive *drv) {
+	vdf_rangeindex *ind = &drv->index;
+	int size;
+
+	if(ind->size <= drv->range_cnt) {
+		size = drv->range_cnt + (drv->range_cnt / 8) + 1;
+		range_index_free(ind);
+		ind->sectend = malloc(sizeof(sector_t) * size);
+		ind->fatend = malloc(sizeof(cluster_t) * size);
+		ind->rank = malloc(sizeof(int) * size);
+		if((ind->sectend == NULL) || (ind->fatend == NULL) || (ind->rank == NULL)) {
+			range_index_free(ind);
+			errno = ENOMEM;
+			return -1;
+		}
+		ind->size = size;
+	}
+	ind->cnt = drv->range_cnt;
+	build(ind, drv->ranges, 0, 1);
+	return 0;
+}
+
+/* strip the trailing 'went right' steps (and the one 'went left' step before them)
+   to get back to the node where the search last went left, ie. the first key > value */
+static INLINE unsigned int eytz_result(unsigned int k) {
+#ifdef __GNUC__
+	return k >> __builtin_ffs(~k);
+#else
+	while(k & 1)
+		k >>= 1;
+	return k >> 1;
+#endif
+}
+
+int range_find_sector(vdf_drive *drv, sector_t sector) {
+	vdf_rangeindex *ind = &drv->index;
+	unsigned int k = 1;
+
+	while(k <= (unsigned int)ind->cnt) {
+#ifdef __GNUC__
+		__builtin_prefetch(ind->sectend + (k * 16));
+#endif
+		k = (2 * k) + (ind->sectend[k] <= sector);
+	}
+	k = eytz_result(k);
+	if(k == 0)
+		return -1;
+	return ind->rank[k];
+}
+
+int range_find_cluster(vdf_drive *drv, cluster_t clust) {
+	vdf_rangeindex *ind = &drv->index;
+	unsigned int k = 1;
+
+	while(k <= (unsigned int)ind->cnt) {
+#ifdef __GNUC__
+		__builtin_prefetch(ind->fatend + (k * 16));
+#endif
+		k = (2 * k) + (ind->fatend[k] <= clust);
+	}
+	k = eytz_result(k);
+	if(k == 0)
+		return -1;
+	return ind->rank[k];
+}
+
+/* as above, but first try 'hint' and the range after it, which is where a
+   sequential read will be */
+int range_find_sector_from(vdf_drive *drv, sector_t sector, int hint) {
+	vdf_filerange *r;
+
+	if((hint >= 0) && (hint < drv->range_cnt)) {
+		r = drv->ranges + hint;
+		if(sector >= r->sectstart) {
+			if(sector < r->sectend)
+				return hint;
+			if((++hint < drv->range_cnt) && (sector < (++r)->sectend) && (sector >= r->sectstart))
+				return hint;
+		}
+	}
+	return range_find_sector(drv, sector);
+}
+
+int range_find_cluster_from(vdf_drive *drv, cluster_t clust, int hint) {
+	vdf_filerange *r;
+
+	if((hint >= 0) && (hint < drv->range_cnt)) {
+		r = drv->ranges + hint;
+		if(clust >= r->fatstart) {
+			if(clust < r->fatend)
+				return hint;
+			if((++hint < drv->range_cnt) && (clust < (++r)->fatend) && (clust >= r->fatstart))
+				return hint;
+		}
+	}
+	return range_find_cluster(drv, clust);
+}
@@ -32,47 +32,44 @@
 #include "vdf_drive.h"
 #include "vdf_file.h"
 #include "vdf_read.h"
+#include "vdf_uring.h"
+#include "vdf_metacache.h"
 
-LIBFUNC int vdf_read_sector(vdf_drive *drv, sector_t sector, void *buffer) {
-	return vdf_read_sectors(drv, sector, 1, buffer);
-}
-
-LIBFUNC int vdf_read_sectors(vdf_drive *drv, sector_t sector, sectcnt_t cnt, void *buffer) {
-	ssize_t want, rem;
-	uint8_t *buff = buffer;
+LIBFUNC vdf_read_ctx *vdf_read_ctx_create(vdf_drive *drv) {
+	vdf_read_ctx *ctx;
 
 	if(!drive_is_valid(drv)) {
 		errno = EINVAL;
-		return -1;
+		return NULL;
 	}
-	if(cnt == 0)
-		return 0;
-	rem = cnt;
-	cnt = 0;
-	if(drv->flags & VDF_MBR) {
-		if(sector == 0) {
-			if(read_sector_mbr(drv, buff) == -1)
-				return -1;
-			if(--rem == 0)
-				return 1;
-			buff += drv->bps;
-			cnt = 1;
-			sector++;
-		}
-		if(sector < drv->mbr_sectors) {
-			want = rem;
-			if((sector + rem) >= drv->mbr_sectors)
-				want = drv->mbr_sectors - sector;
-			memset(buff, 0, drv->bps * want);
-			rem -= want;
-			cnt += want;
-			if(rem == 0)
-				return cnt;
-			sector += want;
-			buff += want * drv->bps;
-		}
-		sector -= drv->mbr_sectors;
+	ctx = malloc(sizeof(vdf_read_ctx));
+	if(ctx == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	read_ctx_init(ctx, drv);
+	ctx->flags |= RCF_ASYNC;
+	return ctx;
+}
+
+LIBFUNC int vdf_read_ctx_free(vdf_read_ctx *ctx) {
+	if(ctx == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
+#ifdef USE_IO_URING
+	if(ctx->ring != NULL)
+		uring_free(ctx->ring);
+#endif
+	free(ctx);
+	return 0;
+}
+
+/* boot sectors, both FATs and the FAT12/16 root directory, 'sector' is below data_start */
+static int read_meta(vdf_read_ctx *ctx, sector_t sector, sectcnt_t rem, uint8_t *buff, void *arg) {
+	vdf_drive *drv = ctx->drv;
+	ssize_t want;
+
 	if(sector < drv->fat1_start) {
 		want = rem;
 		if((sector + rem) >= drv->fat1_start)
@@ -80,9 +77,8 @@ LIBFUNC int vdf_read_sectors(vdf_drive *drv, sector_t sector, sectcnt_t cnt, voi
 		if(read_sector_boot(drv, sector, want, buff) == -1)
 			return -1;
 		rem -= want;
-		cnt += want;
 		if(rem == 0)
-			return cnt;
+			return 0;
 		sector += want;
 		buff += want * drv->bps;
 	}
@@ -95,17 +91,16 @@ LIBFUNC int vdf_read_sectors(vdf_drive *drv, sector_t sector, sectcnt_t cnt, voi
 			if(read_sector_fat_clustlist(drv, sector - drv->fat1_start, want, buff) == -1)
 				return -1;
 		} else {
-			if(read_sector_fat(drv, sector - drv->fat1_start, want, buff) == -1)
+			if(read_sector_fat(drv, ctx, sector - drv->fat1_start, want, buff) == -1)
 				return -1;
 		}
 #else
-		if(read_sector_fat(drv, sector - drv->fat1_start, want, buff) == -1)
+		if(read_sector_fat(drv, ctx, sector - drv->fat1_start, want, buff) == -1)
 			return -1;
 #endif
 		rem -= want;
-		cnt += want;
 		if(rem == 0)
-			return cnt;
+			return 0;
 		sector += want;
 		buff += want * drv->bps;
 	}
@@ -123,62 +118,194 @@ LIBFUNC int vdf_read_sectors(vdf_drive *drv, sector_t sector, sectcnt_t cnt, voi
 			if(read_sector_fat_clustlist(drv, sector - drv->fat2_start, want, buff) == -1)
 				return -1;
 		} else {
-			if(read_sector_fat(drv, sector - drv->fat2_start, want, buff) == -1)
+			if(read_sector_fat(drv, ctx, sector - drv->fat2_start, want, buff) == -1)
 				return -1;
 		}
 #else
-		if(read_sector_fat(drv, sector - drv->fat2_start, want, buff) == -1)
+		if(read_sector_fat(drv, ctx, sector - drv->fat2_start, want, buff) == -1)
 			return -1;
 #endif
 		rem -= want;
-		cnt += want;
 		if(rem == 0)
-			return cnt;
+			return 0;
 		sector += want;
 		buff += want * drv->bps;
 	}
-	if((drv->filesys != VDF_FAT32) && (sector < drv->data_start)) {
-		want = rem;
-		if((sector + rem) >= drv->data_start)
-			want = drv->data_start - sector;
-		if(read_sector_dir(drv, sector - drv->root_start, want, buff, drv->root_dir) == -1)
+	if(read_sector_dir(drv, ctx, sector - drv->root_start, rem, buff, drv->root_dir) == -1)
+		return -1;
+	return 0;
+}
+
+static int read_meta_cached(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buff) {
+	if(cnt == 0)
+		return 0;
+#ifdef ENABLE_CLUSTER_LIST
+	/* the FAT changes as the drive is written to */
+	if(ctx->drv->flags & VDF_CLUSTERLIST)
+		return read_meta(ctx, sector, cnt, buff, NULL);
+#endif
+	return metacache_read(ctx, sector, cnt, buff, read_meta, NULL);
+}
+
+/*
+	FAT2 is a copy of FAT1, so its sectors are read as the FAT1 sectors they mirror.
+	That way both copies share metadata cache entries, and when a request covers
+	both, the part already generated for FAT1 is copied rather than generated again.
+*/
+static int read_meta_mirrored(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buff) {
+	vdf_drive *drv = ctx->drv;
+	sector_t end, fat2_end, fat1_have, s, e;
+	uint8_t *fat1_buff = NULL;
+	sectcnt_t want;
+
+	end = sector + cnt;
+	fat2_end = drv->fat2_start + drv->fat_sectors;
+	if((drv->fat_cnt < 2) || (end <= drv->fat2_start) || (sector >= fat2_end))
+		return read_meta_cached(ctx, sector, cnt, buff);
+
+	/* FAT relative sector from which the rest of FAT1 is in fat1_buff */
+	fat1_have = drv->fat_sectors;
+	if(sector < drv->fat2_start) {
+		want = drv->fat2_start - sector;
+		if(read_meta_cached(ctx, sector, want, buff) == -1)
 			return -1;
-		rem -= want;
-		cnt += want;
-		if(rem == 0)
-			return cnt;
-		sector += want;
+		fat1_have = (sector > drv->fat1_start) ? sector - drv->fat1_start : 0;
+		fat1_buff = buff + (drv->fat1_start + fat1_have - sector) * drv->bps;
 		buff += want * drv->bps;
+		sector += want;
 	}
-	want = rem;
-	if((sector + rem) >= drv->sectors)
-		want = drv->sectors - sector;
-#ifdef ENABLE_CLUSTER_LIST
-	if(drv->flags & VDF_CLUSTERLIST) {
-		if(read_sector_data_clustlist(drv, sector, want, buff) == -1)
+
+	s = sector - drv->fat2_start;
+	e = ((end < fat2_end) ? end : fat2_end) - drv->fat2_start;
+	if(s < fat1_have) {
+		want = ((e < fat1_have) ? e : fat1_have) - s;
+		if(read_meta_cached(ctx, drv->fat1_start + s, want, buff) == -1)
 			return -1;
-	} else {
-		if(read_sector_data(drv, sector, want, buff) == -1)
+		buff += want * drv->bps;
+		s += want;
+	}
+	if(s < e) {
+		memcpy(buff, fat1_buff + (s - fat1_have) * drv->bps, (e - s) * drv->bps);
+		buff += (e - s) * drv->bps;
+	}
+	sector = drv->fat2_start + e;
+
+	if(sector < end)
+		return read_meta_cached(ctx, sector, end - sector, buff);
+	return 0;
+}
+
+/* 'cnt' partition sectors that aren't in the zero map */
+static int read_partition(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buff) {
+	vdf_drive *drv = ctx->drv;
+	sectcnt_t want;
+
+	if(sector < drv->data_start) {
+		want = cnt;
+		if((sector + cnt) >= drv->data_start)
+			want = drv->data_start - sector;
+		if(read_meta_mirrored(ctx, sector, want, buff) == -1)
 			return -1;
+		cnt -= want;
+		if(cnt == 0)
+			return 0;
+		sector += want;
+		buff += want * drv->bps;
 	}
-#else
-	if(read_sector_data(drv, sector, want, buff) == -1)
-		return -1;
+#ifdef ENABLE_CLUSTER_LIST
+	if(drv->flags & VDF_CLUSTERLIST)
+		return read_sector_data_clustlist(drv, sector, cnt, buff);
 #endif
-	cnt += want;
+	return read_sector_data(drv, ctx, sector, cnt, buff);
+}
+
+/*
+	Where a zero span starts as far as read_sectors() is concerned. The slack after each
+	file in the data area is cleared by read_sector_data() anyway, so reads carry on over
+	it and a single plan can take in the reads of several files.
+*/
+static INLINE sector_t span_start(vdf_drive *drv, int z) {
+	sector_t start = drv->zeros[z].start;
+	if((start >= drv->data_start) && (start < drv->data_end))
+		return drv->data_end;
+	return start;
+}
+
+static int read_sectors(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, void *buffer) {
+	vdf_drive *drv = ctx->drv;
+	ssize_t want, rem;
+	int z;
+	uint8_t *buff = buffer;
+
+	if(cnt == 0)
+		return 0;
+	if(ctx->epoch != drv->epoch)
+		read_ctx_reset(ctx);
+	rem = cnt;
+	cnt = 0;
+	if(drv->flags & VDF_MBR) {
+		if(sector == 0) {
+			if(read_sector_mbr(drv, buff) == -1)
+				return -1;
+			if(--rem == 0)
+				return 1;
+			buff += drv->bps;
+			cnt = 1;
+			sector++;
+		}
+		if(sector < drv->mbr_sectors) {
+			want = rem;
+			if((sector + rem) >= drv->mbr_sectors)
+				want = drv->mbr_sectors - sector;
+			memset(buff, 0, drv->bps * want);
+			rem -= want;
+			cnt += want;
+			if(rem == 0)
+				return cnt;
+			sector += want;
+			buff += want * drv->bps;
+		}
+		sector -= drv->mbr_sectors;
+	}
+	if(sector >= drv->sectors)
+		return cnt;
+	if((sector + rem) > drv->sectors)
+		rem = drv->sectors - sector;
+	z = zeromap_find_from(drv, sector, ctx->zero_span);
+	while(rem != 0) {
+		/* spans that are entirely cluster slack don't stop a read of the data area */
+		if((z < drv->zero_cnt) && (span_start(drv, z) >= drv->zeros[z].end))
+			z = zeromap_find(drv, drv->data_end);
+		if((z < drv->zero_cnt) && (span_start(drv, z) <= sector)) {
+			want = drv->zeros[z].end - sector;
+			if(want > rem)
+				want = rem;
+			else
+				z++;
+			memset(buff, 0, want * drv->bps);
+		} else {
+			want = rem;
+			if((z < drv->zero_cnt) && ((span_start(drv, z) - sector) < (sector_t)want))
+				want = span_start(drv, z) - sector;
+			if(read_partition(ctx, sector, want, buff) == -1)
+				return -1;
+		}
+		rem -= want;
+		cnt += want;
+		sector += want;
+		buff += want * drv->bps;
+	}
+	ctx->zero_span = z;
 	return cnt;
 }
 
-LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt, void *buffer) {
+static sdrivesz_t read_bytes(vdf_read_ctx *ctx, driveoff_t off, drivesz_t cnt, void *buffer) {
+	vdf_drive *drv = ctx->drv;
 	sector_t soff, doff;
 	size_t r, want, wbyte;
 	drivesz_t rcnt;
 	char *sbuff = NULL, *buff;
 
-	if(!drive_is_valid(drv)) {
-		errno = EINVAL;
-		return -1;
-	}
 	if(cnt == 0)
 		return 0;
 	buff = buffer;
@@ -192,7 +319,7 @@ LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt,
 		want = drv->bps - want;
 		if(want > cnt)
 			want = cnt;
-		if((r = vdf_read_sectors(drv, soff, 1, sbuff)) != 1)
+		if((r = read_sectors(ctx, soff, 1, sbuff)) != 1)
 			return r;
 		memcpy(buff, sbuff + doff, want);
 		buff += want;
@@ -202,7 +329,7 @@ LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt,
 	}
 	want = cnt / drv->bps;
 	if(want != 0) {
-		r = vdf_read_sectors(drv, soff, want, buff);
+		r = read_sectors(ctx, soff, want, buff);
 		if(r == -1)
 			return -1;
 		if(r < want)
@@ -218,7 +345,7 @@ LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt,
 			if((sbuff = alloca(drv->bps)) == NULL)
 				return -1;
 		}
-		r = vdf_read_sectors(drv, soff, 1, sbuff);
+		r = read_sectors(ctx, soff, 1, sbuff);
 		if(r == -1)
 			return -1;
 		if(r == 0)
@@ -229,3 +356,44 @@ LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt,
 	return rcnt;
 }
 
+LIBFUNC int vdf_read_sector(vdf_drive *drv, sector_t sector, void *buffer) {
+	return vdf_read_sectors(drv, sector, 1, buffer);
+}
+
+LIBFUNC int vdf_read_sectors(vdf_drive *drv, sector_t sector, sectcnt_t cnt, void *buffer) {
+	vdf_read_ctx ctx;
+
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	read_ctx_init(&ctx, drv);
+	return read_sectors(&ctx, sector, cnt, buffer);
+}
+
+LIBFUNC sdrivesz_t vdf_read_bytes(vdf_drive *drv, driveoff_t off, drivesz_t cnt, void *buffer) {
+	vdf_read_ctx ctx;
+
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	read_ctx_init(&ctx, drv);
+	return read_bytes(&ctx, off, cnt, buffer);
+}
+
+LIBFUNC int vdf_read_sectors_ctx(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, void *buffer) {
+	if((ctx == NULL) || !drive_is_valid(ctx->drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return read_sectors(ctx, sector, cnt, buffer);
+}
+
+LIBFUNC sdrivesz_t vdf_read_bytes_ctx(vdf_read_ctx *ctx, driveoff_t off, drivesz_t cnt, void *buffer) {
+	if((ctx == NULL) || !drive_is_valid(ctx->drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return read_bytes(ctx, off, cnt, buffer);
+}
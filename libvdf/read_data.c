@@ -38,116 +38,524 @@
 #include "vdf_drive.h"
 #include "vdf_file.h"
 #include "vdf_read.h"
+#include "vdf_fdcache.h"
+#include "vdf_metacache.h"
+#include "vdf_uring.h"
 
-static INLINE vdf_file *find_file_sector(vdf_drive *drv, sector_t sector) {
-#if 1
+static INLINE vdf_filerange *find_range_sector(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector) {
 	int i;
-	vdf_filerange *range;
 	if(sector >= drv->data_end)
 		return NULL;
-	range = drv->ranges;
-	for(i=0; i<drv->file_cnt; i++, range++) {
-		if(sector < range->sectend) {
-			return range->file;
-		}
-	}
-	return NULL;
-#else
-	/* TODO: test this and use it */
-	int low, high, mid;
-	if(sector >= drv->data_end)
+	i = range_find_sector_from(drv, sector, ctx->data_range);
+	if(i == -1)
 		return NULL;
-	low = 0;
-	high = drv->file_cnt;
-	while(low < high) {
-		mid = low + ((high - low) / 2);
-		if(drv->ranges[mid].sectend < sect)
-			low = mid + 1;
-		else
-			high = mid;
-	}
-	if((low < drv->file_cnt) && (drv->ranges[low].sectend < sector)) {
-		return drv->ranges[low].file;
-	}
-	return NULL;
-#endif
+	ctx->data_range = i;
+	return drv->ranges + i;
 }
 
-#ifdef _MSC_VER
-#define OPEN_FLAGS		_O_RDONLY | _O_BINARY
-#else
-#define OPEN_FLAGS		O_RDONLY
+static int read_dir_meta(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buffer, void *arg) {
+	vdf_file *dir = arg;
+	return read_sector_dir(ctx->drv, ctx, sector - dir->startsect, cnt, buffer, dir);
+}
+
+#ifdef USE_IO_URING
+static vdf_uring *ctx_ring(vdf_read_ctx *ctx) {
+	if((ctx->ring == NULL) && (ctx->flags & RCF_ASYNC) && !(ctx->flags & RCF_NO_ASYNC)) {
+		ctx->ring = uring_create(URING_ENTRIES);
+		if(ctx->ring == NULL)
+			ctx->flags |= RCF_NO_ASYNC;
+	}
+	return ctx->ring;
+}
 #endif
 
-int read_sector_data(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer) {
-	vdf_file *fil;
-	int fd;
+/* vdf_file_requests sent out for a plan that haven't been completed yet. A deferred read
+   shares one between all of its plans and nobody waits for it: 'done' is called by
+   whoever completes the last request instead. */
+typedef struct _async_wait {
+	vdf_mutex		lock;
+	vdf_cond		cond;
+	int				pending;
+	int				err;						/* first error reported */
+	read_done_func	done;						/* deferred read: called when 'pending' drops to 0 */
+	void			*priv;
+	struct _async_block *blocks;				/* deferred read: requests sent out so far */
+} async_wait;
+
+/* The requests for one plan of a deferred read, which are still needed after plan_exec() */
+typedef struct _async_block {
+	struct _async_block *next;
+	vdf_file_request reqs[PLAN_OPS];
+	vdf_file_range	ranges[PLAN_OPS];
+} async_block;
+
+static void async_release(async_wait *w, int err) {
+	read_done_func done;
+	async_block *blk;
+	int last;
+
+	mutex_lock(&w->lock);
+	if((err != 0) && (w->err == 0))
+		w->err = err;
+	last = (--w->pending == 0);
+	done = w->done;
+	if(last && (done == NULL))
+		cond_signal(&w->cond);
+	mutex_unlock(&w->lock);
+	if(!last || (done == NULL))
+		return;
+	while((blk = w->blocks) != NULL) {
+		w->blocks = blk->next;
+		free(blk);
+	}
+	mutex_destroy(&w->lock);
+	done(w->priv, w->err);
+	free(w);
+}
+
+static void async_complete(vdf_file_request *req, int err) {
+	async_release(req->priv, err);
+}
+
+/* Send one request per VFF_ASYNC file in the plan, covering all of its ranges */
+static void async_submit(vdf_read_ctx *ctx, vdf_read_op *ops, int n, vdf_file_request *reqs, vdf_file_range *ranges, async_wait *w) {
+	vdf_drive *drv = ctx->drv;
+	vdf_file_request *req;
+	uint8_t grouped[PLAN_OPS];
+	int i, j, nreq = 0, nrange = 0;
+
+	memset(grouped, 0, n);
+	for(i=0; i<n; i++) {
+		if((ops[i].type != RDO_ASYNC) || grouped[i])
+			continue;
+		req = reqs + nreq++;
+		req->file = ops[i].file;
+		req->cnt = 0;
+		req->ranges = ranges + nrange;
+		req->complete = async_complete;
+		req->priv = w;
+		for(j=i; j<n; j++) {
+			if((ops[j].type == RDO_ASYNC) && (ops[j].file == req->file)) {
+				grouped[j] = 1;
+				ranges[nrange].off = ops[j].off;
+				ranges[nrange].len = ops[j].len;
+				ranges[nrange].buf = ops[j].dst;
+				nrange++;
+				req->cnt++;
+			}
+		}
+	}
+	mutex_lock(&drv->req_lock);
+	for(i=0; i<nreq; i++)
+		reqs[i].id = ++drv->req_id;
+	mutex_unlock(&drv->req_lock);
+
+	mutex_lock(&w->lock);
+	w->pending += nreq;
+	mutex_unlock(&w->lock);
+	for(i=0; i<nreq; i++) {
+		errno = 0;
+		if(reqs[i].file->virt.acback(reqs + i, reqs[i].file->virt.param) == -1)
+			async_complete(reqs + i, errno ? errno : EIO);
+	}
+}
+
+static int async_wait_all(async_wait *w) {
+	int err;
+
+	mutex_lock(&w->lock);
+	while(w->pending != 0)
+		cond_wait(&w->cond, &w->lock);
+	err = w->err;
+	mutex_unlock(&w->lock);
+	return err;
+}
+
+/* Finish an asynchronous read that came back short or failed */
+static ssize_t finish_read(vdf_read_op *op) {
+	ssize_t done, r;
+
+	done = op->res;
+	if(done == 0)
+		return 0;
+	if(done < 0)
+		done = 0;
+	if(done == op->len)
+		return done;
+	r = file_pread(op->fd, op->dst + done, op->len - done, op->off + done);
+	if(r == -1)
+		return -1;
+	return done + r;
+}
+
+/* Carry out a planned read. Requests for asynchronous virtual files are sent out first,
+   so their providers can work on them while the rest of the plan is carried out, and the
+   descriptors for all the real files are fetched. When there is more than one file, the
+   reads are submitted together with io_uring and everything else is generated while the
+   kernel works on them, or without it the kernel is told about every extent before the
+   first is read so that it can fetch them all at once rather than one after another. A
+   single file is just read, as a ring submission would only add a system call. During a
+   deferred read the providers are left to finish on their own. */
+static int plan_exec(vdf_read_ctx *ctx, vdf_read_op *ops, int n) {
+	vdf_read_op *op;
+	vdf_file_request reqs[PLAN_OPS];
+	vdf_file_range ranges[PLAN_OPS];
+	async_wait w, *aw = ctx->defer;
+	async_block *blk;
 	ssize_t cnt;
+	int i, files = 0, async = 0, pending = 0, ret = 0, err;
+
+	for(i=0, op=ops; i<n; i++, op++) {
+		if(op->type == RDO_ASYNC)
+			async++;
+	}
+	if((async != 0) && (aw == NULL)) {
+		aw = &w;
+		mutex_init(&w.lock);
+		cond_init(&w.cond);
+		w.pending = 0;
+		w.err = 0;
+		w.done = NULL;
+		w.blocks = NULL;
+		async_submit(ctx, ops, n, reqs, ranges, &w);
+	} else if(async != 0) {
+		blk = malloc(sizeof(async_block));
+		if(blk == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		blk->next = aw->blocks;
+		aw->blocks = blk;
+		async_submit(ctx, ops, n, blk->reqs, blk->ranges, aw);
+	}
+	for(i=0, op=ops; i<n; i++, op++) {
+		if(op->type != RDO_FILE)
+			continue;
+		op->fd = fdcache_get(op->file);
+		if(op->fd == -1) {
+			ret = -1;
+			goto finish;
+		}
+		file_readahead(ctx, op->file, op->off, op->len, op->fd);
+		files++;
+	}
+#ifdef USE_IO_URING
+	if((files > 1) && (ctx_ring(ctx) != NULL)) {
+		pending = uring_submit(ctx->ring, ops, n);
+		if(pending == -1)
+			pending = 0;
+	}
+#endif
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	if((pending == 0) && (files > 1)) {
+		for(i=0, op=ops; i<n; i++, op++) {
+			if(op->type == RDO_FILE)
+				posix_fadvise(op->fd, op->off, op->len, POSIX_FADV_WILLNEED);
+		}
+	}
+#endif
+	for(i=0, op=ops; i<n; i++, op++) {
+		switch(op->type) {
+			case RDO_DIR:
+				/* an encoded directory is already as cheap as the cache */
+				if(op->file->dir.blob != NULL)
+					cnt = read_dir_meta(ctx, op->off, op->len, op->dst, op->file);
+				else
+					cnt = metacache_read(ctx, op->off, op->len, op->dst, read_dir_meta, op->file);
+				if(cnt == -1) {
+					ret = -1;
+					goto finish;
+				}
+				continue;
+			case RDO_VIRT:
+				file_readahead(ctx, op->file, op->off, op->len, -1);
+				cnt = op->file->virt.cback(vfc_read, op->file, op->off, op->len, op->dst, op->file->virt.param);
+				break;
+			case RDO_MEM:
+				file_readahead(ctx, op->file, op->off, op->len, -1);
+				cnt = 0;
+				if(op->off < op->file->real.map_len) {
+					cnt = op->file->real.map_len - op->off;
+					if(cnt > op->len)
+						cnt = op->len;
+					memcpy(op->dst, (uint8_t*)op->file->real.map + op->off, cnt);
+				}
+				break;
+			case RDO_ASYNC:
+				/* only the padding, the provider fills in the data */
+				cnt = op->len;
+				break;
+			case RDO_FILE:
+				if(pending != 0)
+					continue;
+				cnt = file_pread(op->fd, op->dst, op->len, op->off);
+				break;
+			default:
+				cnt = 0;
+				break;
+		}
+		if(cnt == -1) {
+			ret = -1;
+			goto finish;
+		}
+		if(cnt > op->len)
+			cnt = op->len;
+		/* short files and the rest of the last cluster read as zeros */
+		memset(op->dst + cnt, 0, (op->len - cnt) + op->pad);
+	}
+#ifdef USE_IO_URING
+	if(pending != 0) {
+		uring_wait(ctx->ring, ops, pending);
+		pending = 0;
+		for(i=0, op=ops; i<n; i++, op++) {
+			if(op->type != RDO_FILE)
+				continue;
+			cnt = finish_read(op);
+			if(cnt == -1) {
+				ret = -1;
+				goto finish;
+			}
+			if(cnt > op->len)
+				cnt = op->len;
+			memset(op->dst + cnt, 0, (op->len - cnt) + op->pad);
+		}
+	}
+#endif
+finish:
+#ifdef USE_IO_URING
+	/* the kernel may still be writing to the buffer */
+	if(pending != 0)
+		uring_wait(ctx->ring, ops, pending);
+#endif
+	if((async != 0) && (aw == &w)) {
+		/* even after a failure, the providers may still be writing to the buffer */
+		err = async_wait_all(&w);
+		cond_destroy(&w.cond);
+		mutex_destroy(&w.lock);
+		if((err != 0) && (ret == 0)) {
+			errno = err;
+			ret = -1;
+		}
+	}
+	for(i=0, op=ops; i<n; i++, op++) {
+		if((op->type == RDO_FILE) && (op->fd != -1))
+			fdcache_put(op->file, op->fd);
+	}
+	return ret;
+}
+
+/* the reads are planned from the ranges alone, the files are only looked at by plan_exec() */
+int read_sector_data(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer) {
+	vdf_read_op ops[PLAN_OPS], *op;
+	vdf_filerange *rng;
 	sectoff_t off;
-	size_t want, swant;
+	size_t swant;
+	int n;
 
 	while(scnt) {
-		fil = find_file_sector(drv, sector);
-		if(fil == NULL) {
-			memset(buffer, 0, scnt * drv->bps);
-			return 0;
-		}
-		off = sector - fil->startsect;
-		swant = fil->endsect - sector;
-		if(swant > scnt)
-			swant = scnt;
-		if(vdf_file_is_dir(fil)) {
+		for(n = 0; (scnt != 0) && (n < PLAN_OPS); n++) {
+			op = ops + n;
+			op->dst = buffer;
+			op->fd = -1;
+			rng = find_range_sector(drv, ctx, sector);
+			if(rng == NULL) {
+				op->type = RDO_ZERO;
+				op->file = NULL;
+				op->len = 0;
+				op->pad = scnt * drv->bps;
+				scnt = 0;
+				continue;
+			}
+			op->file = rng->file;
+			off = sector - rng->sectstart;
+			swant = rng->sectend - sector;
+			if(swant > scnt)
+				swant = scnt;
+			if(rng->type == RDO_DIR) {
 #ifdef WRITE_DEBUG
-			printf("%s dir @ sector %u (off=%u , swant=%u , scnt=%u\n", fil->shortname, sector, off, swant, scnt);
+				printf("%s dir @ sector %u (off=%u , swant=%u , scnt=%u\n", rng->file->shortname, sector, off, swant, scnt);
 #endif
-			if(read_sector_dir(drv, off, swant, buffer, fil) == -1)
-				return -1;
+				op->type = RDO_DIR;
+				op->off = sector;
+				op->len = swant;
+				op->pad = 0;
+			} else {
+				off = off * drv->bps;
+				if(off >= rng->size) {
+					op->type = RDO_ZERO;
+					op->len = 0;
+				} else {
+					op->type = rng->type;
+					op->off = off;
+					op->len = rng->size - off;
+					if(op->len > (swant * drv->bps))
+						op->len = swant * drv->bps;
+				}
+				op->pad = (swant * drv->bps) - op->len;
+#ifdef WRITE_DEBUG
+				printf("%s file @ sector %u (off=%u , want=%u, swant=%u , scnt=%u\n", rng->file->shortname, sector, off, op->len, swant, scnt);
+#endif
+			}
 			sector += swant;
 			scnt -= swant;
 			buffer += swant * drv->bps;
-			continue;
-		}
-		off = off * drv->bps;
-		if(off >= fil->size) {
-			want = swant * drv->bps;
-			memset(buffer, 0, want);
-			sector += swant;
-			scnt -= swant;
-			buffer += want;
-			continue;
 		}
-		want = fil->size - off;
-		if(want > (scnt * drv->bps))
-			want = scnt * drv->bps;
-		if(vdf_file_is_virt(fil)) {
-			cnt = fil->virt.cback(vfc_write, fil, off, want, buffer, fil->virt.param);
-		} else {
-			fd = open(fil->real.path, OPEN_FLAGS);
-			if(fd == -1)
-				return -1;
-			lseek(fd, off, SEEK_SET);
-			cnt = read(fd, buffer, want);
-			close(fd);
+		if(plan_exec(ctx, ops, n) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Find out how the bytes starting at drive offset 'off' can be served. VXT_MEM and VXT_FILE
+   are only used for data that is actually in a real file, whole sectors in the zero map are
+   VXT_ZERO and everything else (metadata, virtual files) is VXT_BUFFER up to the start of
+   the next real file or zero span. */
+int read_extent(vdf_read_ctx *ctx, driveoff_t off, drivesz_t len, vdf_extent *ext) {
+	vdf_drive *drv = ctx->drv;
+	vdf_filerange *rng;
+	vdf_file *fil;
+	driveoff_t base, start;
+	sector_t sector;
+	int r, z;
+
+	if(ctx->epoch != drv->epoch)
+		read_ctx_reset(ctx);
+	ext->type = VXT_BUFFER;
+	ext->len = len;
+	ext->file = NULL;
+	ext->fd = -1;
+	ext->off = 0;
+	ext->ptr = NULL;
+
+	base = (driveoff_t)drv->mbr_sectors * drv->bps;
+	if((off >= base) && (drv->zero_cnt != 0)) {
+		z = zeromap_find_from(drv, (off - base) / drv->bps, ctx->zero_span);
+		ctx->zero_span = z;
+		if(z < drv->zero_cnt) {
+			start = base + ((driveoff_t)drv->zeros[z].start * drv->bps);
+			if(off >= start) {
+				ext->type = VXT_ZERO;
+				start = base + ((driveoff_t)drv->zeros[z].end * drv->bps);
+				if(len > (start - off))
+					ext->len = start - off;
+				return 0;
+			}
+			/* generated data stops at the next hole */
+			if(len > (start - off))
+				ext->len = len = start - off;
 		}
-#ifdef WRITE_DEBUG
-		printf("%s file @ sector %u (off=%u , want=%u, swant=%u , scnt=%u\n", fil->shortname, sector, off, want, swant, scnt);
-#endif
-		if(cnt == -1)
+	}
+	start = base + ((driveoff_t)drv->data_start * drv->bps);
+	if(off < start) {
+		if(len > (start - off))
+			ext->len = start - off;
+		return 0;
+	}
+	sector = (off - base) / drv->bps;
+	if(sector >= drv->data_end)
+		return 0;
+	r = range_find_sector_from(drv, sector, ctx->data_range);
+	if(r == -1)
+		return 0;
+	ctx->data_range = r;
+	rng = drv->ranges + r;
+	fil = rng->file;
+	start = base + ((driveoff_t)rng->sectstart * drv->bps);
+	if((rng->type == RDO_MEM) && ((off - start) < fil->real.map_len)) {
+		ext->type = VXT_MEM;
+		ext->file = fil;
+		ext->off = off - start;
+		ext->ptr = (uint8_t*)fil->real.map + ext->off;
+		if(len > (fil->real.map_len - ext->off))
+			ext->len = fil->real.map_len - ext->off;
+		file_readahead(ctx, fil, ext->off, ext->len, -1);
+		return 0;
+	}
+	if((rng->type == RDO_FILE) && ((off - start) < rng->size)) {
+		ext->fd = fdcache_get(fil);
+		if(ext->fd == -1)
 			return -1;
-		if(cnt > want)
-			cnt = want;
-		buffer += cnt;
-		cnt = (swant * drv->bps) - cnt;
-		if(cnt > 0) {
-			memset(buffer, 0, cnt);
-			buffer += cnt;
+		ext->type = VXT_FILE;
+		ext->file = fil;
+		ext->off = off - start;
+		if(len > (rng->size - ext->off))
+			ext->len = rng->size - ext->off;
+		file_readahead(ctx, fil, ext->off, ext->len, ext->fd);
+		return 0;
+	}
+	for(r++; r < drv->range_cnt; r++) {
+		rng++;
+		start = base + ((driveoff_t)rng->sectstart * drv->bps);
+		if(start >= (off + len))
+			break;
+		if((rng->type == RDO_MEM) || (rng->type == RDO_FILE)) {
+			ext->len = start - off;
+			break;
 		}
-		sector += swant;
-		scnt -= swant;
 	}
 	return 0;
 }
 
+void read_extent_put(vdf_extent *ext) {
+	if(ext->type == VXT_FILE)
+		fdcache_put(ext->file, ext->fd);
+	ext->fd = -1;
+}
+
+/* Whether any of the drive bytes starting at 'off' belong to an asynchronous virtual file */
+int read_range_async(vdf_read_ctx *ctx, driveoff_t off, drivesz_t len) {
+	vdf_drive *drv = ctx->drv;
+	sector_t first, last;
+	int r;
+
+	if(ctx->epoch != drv->epoch)
+		read_ctx_reset(ctx);
+	first = off / drv->bps;
+	last = (off + len + drv->bps - 1) / drv->bps;
+	if(last <= (drv->mbr_sectors + drv->data_start))
+		return 0;
+	first = (first > drv->mbr_sectors) ? (first - drv->mbr_sectors) : 0;
+	last -= drv->mbr_sectors;
+	r = range_find_sector_from(drv, first, ctx->data_range);
+	if(r == -1)
+		return 0;
+	for(; (r < drv->range_cnt) && (drv->ranges[r].sectstart < last); r++) {
+		if(drv->ranges[r].type == RDO_ASYNC)
+			return 1;
+	}
+	return 0;
+}
+
+/* Read sectors like vdf_read_sectors_ctx() without waiting for asynchronous virtual files.
+   Their requests are sent out and 'done' is called once the last of them completes, from
+   the provider's thread or from here if they already have. 'buffer' must be kept until
+   then. -1 is only returned when nothing was started, otherwise 'done' is always called. */
+int read_sectors_deferred(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, void *buffer, read_done_func done, void *priv) {
+	async_wait *w;
+	int r, err = 0;
+
+	w = malloc(sizeof(async_wait));
+	if(w == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	mutex_init(&w->lock);
+	w->pending = 1;						/* held until the last plan has been carried out */
+	w->err = 0;
+	w->done = done;
+	w->priv = priv;
+	w->blocks = NULL;
+	ctx->defer = w;
+	r = vdf_read_sectors_ctx(ctx, sector, cnt, buffer);
+	ctx->defer = NULL;
+	if(r == -1)
+		err = errno ? errno : EIO;
+	else if((sectcnt_t)r != cnt)
+		err = EIO;
+	async_release(w, err);
+	return 0;
+}
+
 #ifdef ENABLE_CLUSTER_LIST
 int _sector_data_clustlist(vdf_drive *drv, off_t clust, off_t
 
@@ -209,7 +617,7 @@ int read_sector_data_clustlist(vdf_drive *drv, off_t sector, size_t scnt, char *
 		if(want > (scnt * drv->bps))
 			want = scnt * drv->bps;
 		if(vdf_file_is_virt(fil)) {
-			cnt = fil->virt.cback(vfc_write, fil, off, want, buffer, fil->virt.param);
+			cnt = fil->virt.cback(vfc_read, fil, off, want, buffer, fil->virt.param);
 		} else {
 			fd = open(fil->real.path, OPEN_FLAGS);
 			if(fd == -1)
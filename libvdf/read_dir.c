@@ -26,7 +26,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vdf.h>
-#include <time.h>
 #include "vdf_drive.h"
 #include "vdf_file.h"
 #include "vdf_read.h"
@@ -77,23 +76,9 @@ int fill_dirent(vdf_drive *drv, uint8_t *buffer, vdf_file *fil, int entnum, int
 	int cnt = 0, i, e, seq;
 	struct dir_ent *ent;
 	struct dir_ent_vfat *vf;
-	char *s, *d;
-	struct tm *t;
-	uint8_t chk;
+	char *s;
 
 	if((force_name == NULL) && (drv->flags & VDF_VFAT) && (fil->flags & VFF_LONGNAME)) {
-		chk = 0;
-		for(i=0, s=fil->shortname; (*s) && (*s != '.') && (i < 8); i++, s++)
-			chk = (chk >> 1) + ((chk & 1) << 7) + *s;
-		for(; i<8; i++)
-			chk = (chk >> 1) + ((chk & 1) << 7) + ' ';
-		if(*s++ == '.') {
-			for(; (i<(8 + 3)) && (*s); i++, s++)
-				chk = (chk >> 1) + ((chk & 1) << 7) + *s;
-		}
-		for(; i<(8 + 3); i++)
-			chk = (chk >> 1) + ((chk & 1) << 7) + ' ';
-
 		s = fil->name + (fil->fent_cnt * 13);
 		entnum -= fil->fent_start;
 		for(e=0, seq=fil->fent_cnt; seq > 0; seq--, e++) {
@@ -106,7 +91,7 @@ int fill_dirent(vdf_drive *drv, uint8_t *buffer, vdf_file *fil, int entnum, int
 				vf->seq |= 1 << 6;
 			vf->attr = 0xf;
 			vf->type = 0;
-			vf->chk = chk;
+			vf->chk = fil->chk;
 			vf->cluster = 0;
 
 			for(i=0; (i<13) && (s[i]); i++) {
@@ -126,43 +111,20 @@ int fill_dirent(vdf_drive *drv, uint8_t *buffer, vdf_file *fil, int entnum, int
 		i = strlen(force_name);
 		memcpy(ent->name, force_name, i);
 		memset(ent->name + i, ' ', (8 + 3) - i);
-	} else {
-		for(i=0, s=fil->shortname, d=ent->name; (*s) && (*s != '.') && (i < 8); i++, s++, d++)
-			*d = *s;
-		for(; i<8; i++, d++)
-			*d = ' ';
-		if(*s++ == '.') {
-			for(; (i<(8 + 3)) && (*s); i++, s++, d++)
-				*d = *s;
-		}
-		for(; i<(8 + 3); i++, d++)
-			*d = ' ';
-	}
+	} else
+		memcpy(ent->name, fil->dosname, 8 + 3);
 	ent->attr = fil->attr;
 	ent->unused = 0;
-	t = gmtime(&fil->date);
-	ent->modified_time = le_16(
-		((t->tm_hour & 0x1f) << 11) |
-		((t->tm_min  & 0x3f) << 5)  |
-		((t->tm_sec / 2) & 0x1f)
-	);
-	i = t->tm_year - 80;
-	if(i < 0)
-		i = 0;
-	else if(i > 127)
-		i = 127;
-	ent->modified_date = le_16(
-		((i & 0x7f) << 9)                |
-		(((t->tm_mon + 1) & 0x0f) << 5) |
-		(t->tm_mday & 0x1f)
-	);
+	ent->modified_time = fil->fat_time;
+	ent->modified_date = fil->fat_date;
 	if(fil->drv->filesys == VDF_FAT32) {
-		ent->create_time_10ms = (t->tm_sec & 1) ? 5 : 0;
+		ent->create_time_10ms = fil->fat_time_10ms;
 		ent->create_time = ent->modified_time;
 		ent->access_date = ent->create_date = ent->modified_date;
 	} else {
 		ent->create_time_10ms = 0;
 		ent->create_time = 0;
+		ent->create_date = 0;
 		ent->access_date = 0;
 	}
 	if(fil->size == 0) {
@@ -249,11 +211,24 @@ int fill_dirent_label(vdf_drive *drv, char *buffer) {
 }
 #endif
 
-int read_sector_dir(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer, vdf_file *dir) {
+int read_sector_dir(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer, vdf_file *dir) {
 	int i, c, ent;
 	int mx;
 	vdf_file *fil;
+	size_t off, len;
 
+	if(dir->dir.blob != NULL) {
+		off = sector * drv->bps;
+		len = scnt * drv->bps;
+		i = 0;
+		if(off < dir->dir.blob_len) {
+			i = (len < (dir->dir.blob_len - off)) ? len : (dir->dir.blob_len - off);
+			memcpy(buffer, dir->dir.blob + off, i);
+		}
+		if((size_t)i < len)
+			memset(buffer + i, 0, len - i);
+		return 0;
+	}
 	if(sector == 0) {
 		if(dir->parent != NULL) {
 			fill_dirent(drv, buffer, dir, 0, 1, ".");
@@ -279,20 +254,30 @@ int read_sector_dir(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *bu
 	scnt *= drv->dirent_per_sector;
 	mx = scnt - i;
 	if(ent < dir->dir.fent_cnt) {
-		if(ent < dir->dir.fent_cnt) {
-			list_foreach_item(vdf_file, fil, &dir->dir.entries, dirlist) {
-				if((fil->fent_start + fil->fent_cnt + 1) <= ent) {
-					continue;
-				} else {
-					c = fill_dirent(drv, buffer, fil, ent, mx, NULL);
-					if(c == -1)
-						return -1;
-					buffer += sizeof(struct dir_ent) * c;
-					i += c;
-					mx -= c;
-					if(i >= scnt)
-						break;
-				}
+		/* carry on from the entry the previous read of this directory stopped at */
+		if((ctx->dir == dir) && (ctx->dir_fil->fent_start <= ent) &&
+				((ctx->dir_fil->fent_start + ctx->dir_fil->fent_cnt + 1 + drv->dirent_per_sector) > ent))
+			fil = ctx->dir_fil;
+		else if(dir_index_valid(dir) && (dir->dir.cnt != 0))
+			fil = dir_index_find(dir, ent);
+		else if((ctx->dir == dir) && (ctx->dir_fil->fent_start <= ent))
+			fil = ctx->dir_fil;
+		else
+			fil = list_item(dir->dir.entries.next, vdf_file, dirlist);
+		list_foreach_item_from(vdf_file, fil, &dir->dir.entries, dirlist) {
+			if((fil->fent_start + fil->fent_cnt + 1) <= ent) {
+				continue;
+			} else {
+				c = fill_dirent(drv, buffer, fil, ent, mx, NULL);
+				if(c == -1)
+					return -1;
+				ctx->dir = dir;
+				ctx->dir_fil = fil;
+				buffer += sizeof(struct dir_ent) * c;
+				i += c;
+				mx -= c;
+				if(i >= scnt)
+					break;
 			}
 		}
 	}
@@ -301,3 +286,39 @@ int read_sector_dir(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *bu
 	return 0;
 }
 
+
+void dir_blob_free(vdf_file *dir) {
+	if(dir->dir.blob != NULL)
+		free(dir->dir.blob);
+	dir->dir.blob = NULL;
+	dir->dir.blob_len = 0;
+}
+
+/*
+	Encode the directory sector by sector, exactly as read_sector_dir() would produce it.
+	Afterwards read_sector_dir() only copies from the blob, so a sector deep into a huge
+	directory costs the same as the first one. Each directory has its own blob so that
+	only the directories that changed are encoded again when the drive is recalculated.
+	Without VDF_DIR_BLOBS any old blob is just thrown away.
+*/
+int dir_blob_build(vdf_drive *drv, vdf_read_ctx *ctx, vdf_file *dir) {
+	uint8_t *blob;
+	size_t len;
+
+	dir_blob_free(dir);
+	if(!(drv->flags & VDF_DIR_BLOBS))
+		return 0;
+	len = ((dir->size + drv->bps - 1) / drv->bps) * drv->bps;
+	blob = malloc(len ? len : 1);
+	if(blob == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if(read_sector_dir(drv, ctx, 0, len / drv->bps, blob, dir) == -1) {
+		free(blob);
+		return -1;
+	}
+	dir->dir.blob = blob;
+	dir->dir.blob_len = len;
+	return 0;
+}
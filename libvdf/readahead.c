@@ -0,0 +1,154 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE)
+#include <sys/mman.h>
+#endif
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+#include "vdf_read.h"
+
+/*
+	Readahead for clients streaming a file.
+
+	Each read context keeps a few streams, one per file being read. A read that starts
+	where the previous read of the file ended (or a little past it) is sequential. Once
+	a stream has been sequential, the range ahead of it is requested from the source: the
+	page cache is asked to load it for real files (posix_fadvise() or madvise() for mapped
+	files) and virtual files added with VAF_READAHEAD get a vfc_readahead hint. Each time
+	the client has used up half of the readahead, the window is doubled, up to ra_max.
+	A non sequential read of the file quarters the window.
+
+	As streams are per context, clients reading the same file through a shared descriptor
+	don't upset each other's detection the way the kernel's per descriptor readahead does.
+*/
+
+static void issue(vdf_file *fil, int fd, fileoff_t off, filesz_t len) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE) && defined(MADV_WILLNEED)
+	long pagesize;
+	uintptr_t start, end;
+#endif
+
+	if(vdf_file_is_virt(fil)) {
+		fil->virt.cback(vfc_readahead, fil, off, len, NULL, fil->virt.param);
+		return;
+	}
+	if(fil->real.map != NULL) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE) && defined(MADV_WILLNEED)
+		if(off >= fil->real.map_len)
+			return;
+		if(len > (fil->real.map_len - off))
+			len = fil->real.map_len - off;
+		pagesize = sysconf(_SC_PAGESIZE);
+		start = ((uintptr_t)fil->real.map + off) & ~(uintptr_t)(pagesize - 1);
+		end = (uintptr_t)fil->real.map + off + len;
+		madvise((void*)start, end - start, MADV_WILLNEED);
+#endif
+		return;
+	}
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	if(fd != -1)
+		posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void file_readahead(vdf_read_ctx *ctx, vdf_file *fil, fileoff_t off, filesz_t len, int fd) {
+	vdf_drive *drv = ctx->drv;
+	vdf_ra_stream *s, *lru;
+	uint64_t end;
+	int i;
+
+	if(drv->ra_max == 0)
+		return;
+	if(vdf_file_is_virt(fil) && !(fil->flags & VFF_READAHEAD))
+		return;
+
+	ctx->ra_clock++;
+	s = NULL;
+	lru = ctx->ra;
+	for(i=0; i<RA_STREAMS; i++) {
+		if(ctx->ra[i].file == fil) {
+			s = ctx->ra + i;
+			break;
+		}
+		if(ctx->ra[i].used < lru->used)
+			lru = ctx->ra + i;
+	}
+	if(s == NULL) {
+		s = lru;
+		s->file = fil;
+		s->window = 0;
+		s->next = s->issued = off + len;
+		s->used = ctx->ra_clock;
+		return;
+	}
+	s->used = ctx->ra_clock;
+	if((off < s->next) || (off > (s->next + RA_MIN_WINDOW))) {
+		s->window /= 4;
+		s->next = s->issued = off + len;
+		return;
+	}
+
+	s->next = off + len;
+	if(s->issued < s->next)
+		s->issued = s->next;
+	if((s->window != 0) && ((s->issued - s->next) >= (s->window / 2)))
+		return;
+	s->window *= 2;
+	if(s->window < RA_MIN_WINDOW)
+		s->window = RA_MIN_WINDOW;
+	if(s->window > drv->ra_max)
+		s->window = drv->ra_max;
+	end = (uint64_t)s->next + s->window;
+	if(end > fil->size)
+		end = fil->size;
+	if(end > s->issued) {
+		issue(fil, fd, s->issued, end - s->issued);
+		s->issued = end;
+	}
+}
+
+LIBFUNC int vdf_set_drive_readahead(vdf_drive *drv, size_t max_bytes) {
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	drv->ra_max = max_bytes;
+	return 0;
+}
+
+LIBFUNC ssize_t vdf_get_drive_readahead(vdf_drive *drv) {
+	if(!drive_is_valid(drv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return drv->ra_max;
+}
@@ -54,6 +54,7 @@ typedef struct _nbdc_data {
 	vdf_sock			sock;
 	char				*buff;
 	size_t				bufflen;
+	vdf_read_ctx		*ctx;
 } nbdc_data;
 
 static int nbdcli_open(vdf_transport *trans, va_list args) {
@@ -136,10 +137,18 @@ static int nbdcli_start(vdf_transport *trans) {
 	dat->buff = malloc(dat->bufflen);
 	if(dat->buff == NULL)
 		return -1;
+	dat->ctx = vdf_read_ctx_create(trans->drv);
+	if(dat->ctx == NULL) {
+		free(dat->buff);
+		dat->buff = NULL;
+		return -1;
+	}
 
 	dat->sock = socket(dat->a_family, dat->a_socktype, dat->a_protocol);
 	if(dat->sock == INVALID_SOCKET) {
 		free(dat->buff);
+		vdf_read_ctx_free(dat->ctx);
+		dat->ctx = NULL;
 		errno = EIO;
 		return -1;
 	}
@@ -147,6 +156,8 @@ static int nbdcli_start(vdf_transport *trans) {
 fail:
 //		perror("");
 		errno = EIO;
+		vdf_read_ctx_free(dat->ctx);
+		dat->ctx = NULL;
 		free(dat->buff);
 		sock_close(dat->sock);
 		dat->sock = INVALID_SOCKET;
@@ -191,6 +202,10 @@ static int nbdcli_stop(vdf_transport *trans) {
 		free(dat->buff);
 		dat->buff = NULL;
 	}
+	if(dat->ctx != NULL) {
+		vdf_read_ctx_free(dat->ctx);
+		dat->ctx = NULL;
+	}
 
 	tcb_conn.id = dat->id;
 	memcpy(&tcb_conn.addr, &dat->addr, sizeof(struct sockaddr));
@@ -264,24 +279,11 @@ static int nbdcli_process(vdf_transport *trans) {
 #endif
 				goto fail;
 			}
-			while(len > 0) {
-				read = len;
-				if(read > bufflen)
-					read = bufflen;
-				if(vdf_read_bytes(drv, off, read, buff) == -1) {
-#ifdef WRITE_DEBUG
-					printf("Failed drive read\n");
-#endif
-					goto fail;
-				}
-				if(sock_write(dat->sock, buff, read) == -1) {
+			if(sock_write_drive(dat->sock, dat->ctx, off, len, buff, bufflen) == -1) {
 #ifdef WRITE_DEBUG
-					printf("Failed data write\n");
+				printf("Failed data write\n");
 #endif
-					goto fail;
-				}
-				len -= read;
-				off += read;
+				goto fail;
 			}
 			break;
 		case NBD_CMD_WRITE:
@@ -33,6 +33,7 @@
 #include <vdf.h>
 #include "../vdf_drive.h"
 #include "../vdf_file.h"
+#include "../vdf_read.h"
 #include "../vdf_transport.h"
 #ifndef _WIN32
 #include <pthread.h>
@@ -41,6 +42,9 @@
 #include "nbd.h"
 
 #define NCF_DELETED		0x01
+#define NCF_FAILED		0x02			/* a deferred reply couldn't be sent */
+
+#define NBD_MAX_DEFERRED	16			/* reads per client waiting for asynchronous virtual files */
 
 typedef struct _nbd_client {
 	int					flags;
@@ -55,8 +59,21 @@ typedef struct _nbd_client {
 	pthread_t			thread;
 #endif
 	vdf_transport		*trans;
+	vdf_mutex			lock;			/* held while a reply is sent, protects 'pending' */
+	vdf_cond			cond;
+	int					pending;		/* deferred reads not replied to yet */
 } nbd_client;
 
+/* A read that covers an asynchronous virtual file. The client thread carries on with the
+   next request and the reply is sent when the provider completes, so a slow provider
+   only holds up the reads that need it. NBD replies are matched by handle, not order. */
+typedef struct _nbd_defer {
+	nbd_client			*cli;
+	struct nbd_reply	reply;
+	size_t				len;
+	uint8_t				*data;			/* the bytes asked for, inside the whole sectors read */
+} nbd_defer;
+
 typedef struct _nbds_data {
 	int					port;
 	vdf_sock			srvsock;
@@ -180,6 +197,56 @@ static void stop_client(nbd_client *cli) {
 #endif
 }
 
+static void client_read_done(void *priv, int err) {
+	nbd_defer *dr = (nbd_defer*)priv;
+	nbd_client *cli = dr->cli;
+
+	if(err != 0)
+		dr->reply.error = htonl(EIO);
+	mutex_lock(&cli->lock);
+	if(!(cli->flags & NCF_FAILED)) {
+		if((sock_write(cli->sock, &dr->reply, sizeof(dr->reply)) == -1) ||
+		   ((err == 0) && (sock_write(cli->sock, dr->data, dr->len) == -1))) {
+			/* the client thread is waiting for the next request, wake it up */
+			cli->flags |= NCF_FAILED;
+			shutdown(cli->sock, 2);
+		}
+	}
+	cli->pending--;
+	cond_signal(&cli->cond);
+	mutex_unlock(&cli->lock);
+	free(dr);
+}
+
+static int client_read_deferred(nbd_client *cli, vdf_read_ctx *ctx, struct nbd_reply *reply, driveoff_t off, size_t len) {
+	vdf_drive *drv = cli->trans->drv;
+	nbd_defer *dr;
+	sector_t sector;
+	sectcnt_t cnt;
+	size_t skip;
+
+	sector = off / drv->bps;
+	skip = off - ((driveoff_t)sector * drv->bps);
+	cnt = (skip + len + drv->bps - 1) / drv->bps;
+	dr = malloc(sizeof(nbd_defer) + ((size_t)cnt * drv->bps));
+	if(dr == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	dr->cli = cli;
+	memcpy(&dr->reply, reply, sizeof(dr->reply));
+	dr->len = len;
+	dr->data = (uint8_t*)(dr + 1) + skip;
+	mutex_lock(&cli->lock);
+	while(cli->pending >= NBD_MAX_DEFERRED)
+		cond_wait(&cli->cond, &cli->lock);
+	cli->pending++;
+	mutex_unlock(&cli->lock);
+	if(read_sectors_deferred(ctx, sector, cnt, (uint8_t*)(dr + 1), client_read_done, dr) == -1)
+		client_read_done(dr, errno);
+	return 0;
+}
+
 #ifdef _WIN32
 static DWORD WINAPI client_threadfunc(LPVOID _clidata) {
 #else
@@ -191,12 +258,14 @@ static void *client_threadfunc(void *_clidata) {
 	vdf_drive *drv = trans->drv;
 	char *buff;
 	size_t bufflen;
+	vdf_read_ctx *ctx;
 	struct nbd_request request;
 	struct nbd_reply reply;
 	uint16_t cmd;
 	driveoff_t off;
 	size_t len, read;
 	vdf_tcb_read tcb_rd;
+	int ret;
 
 #if 1
 	bufflen = drv->bpc;
@@ -205,8 +274,9 @@ static void *client_threadfunc(void *_clidata) {
 	if(drv->bps > bufflen)
 		bufflen = drv->bps;
 #endif
+	ctx = vdf_read_ctx_create(drv);
 	buff = malloc(bufflen);
-	if(buff == NULL)
+	if((buff == NULL) || (ctx == NULL))
 		goto finish;
 
 	tcb_rd.id = cli->id;
@@ -251,31 +321,22 @@ static void *client_threadfunc(void *_clidata) {
 				tcb_rd.off = off;
 				tcb_rd.len = len;
 				trans_cback(trans, tcb_read, &tcb_rd);
-				if(sock_write(cli->sock, &reply, sizeof(reply)) == -1) {
+				if(read_range_async(ctx, off, len)) {
+					if(client_read_deferred(cli, ctx, &reply, off, len) == -1)
+						goto finish;
+					break;
+				}
+				mutex_lock(&cli->lock);
+				ret = sock_write(cli->sock, &reply, sizeof(reply));
+				if(ret != -1)
+					ret = sock_write_drive(cli->sock, ctx, off, len, buff, bufflen);
+				mutex_unlock(&cli->lock);
+				if(ret == -1) {
 #ifdef WRITE_DEBUG
 					printf("Failed reply write\n");
 #endif
 					goto finish;
 				}
-				while(len > 0) {
-					read = len;
-					if(read > bufflen)
-						read = bufflen;
-					if(vdf_read_bytes(drv, off, read, buff) == -1) {
-#ifdef WRITE_DEBUG
-						printf("Failed drive read\n");
-#endif
-						goto finish;
-					}
-					if(sock_write(cli->sock, buff, read) == -1) {
-#ifdef WRITE_DEBUG
-						printf("Failed data write\n");
-#endif
-						goto finish;
-					}
-					len -= read;
-					off += read;
-				}
 				break;
 			case NBD_CMD_WRITE:
 				while(len != 0) {
@@ -287,7 +348,10 @@ static void *client_threadfunc(void *_clidata) {
 				}
 			case NBD_CMD_FLUSH:
 			case NBD_CMD_TRIM:
-				if(sock_write(cli->sock, &reply, sizeof(reply)) == -1)
+				mutex_lock(&cli->lock);
+				ret = sock_write(cli->sock, &reply, sizeof(reply));
+				mutex_unlock(&cli->lock);
+				if(ret == -1)
 					goto finish;
 				break;
 			default:
@@ -295,6 +359,17 @@ static void *client_threadfunc(void *_clidata) {
 		}
 	}
 finish:
+	/* deferred replies still need the client */
+	mutex_lock(&cli->lock);
+	while(cli->pending != 0)
+		cond_wait(&cli->cond, &cli->lock);
+	mutex_unlock(&cli->lock);
+	if(ctx != NULL)
+		vdf_read_ctx_free(ctx);
+	if(buff != NULL)
+		free(buff);
+	cond_destroy(&cli->cond);
+	mutex_destroy(&cli->lock);
 	free_client(cli);
 	return 0;
 }
@@ -323,16 +398,21 @@ static int nbdserv_process(vdf_transport *trans) {
 		cli->sock = sock;
 		cli->trans = trans;
 		cli->id = trans_get_id();
+		mutex_init(&cli->lock);
+		cond_init(&cli->cond);
+		cli->pending = 0;
 #ifdef _WIN32
 		cli->thread = CreateThread(NULL, 0, client_threadfunc, cli, 0, &tid);
 		if(cli->thread == NULL) {
 			errno = ENOEXEC;
 #else
 		tid = pthread_create(&cli->thread, NULL, client_threadfunc, cli);
-		if(tid == 0) {
-			errno = -tid;
+		if(tid != 0) {
+			errno = tid;
 #endif
 			trans_set_error(trans, errno);
+			cond_destroy(&cli->cond);
+			mutex_destroy(&cli->lock);
 			sock_close(sock);
 			free(cli);
 			return -1;
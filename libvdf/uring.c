@@ -0,0 +1,204 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <vdf.h>
+#include "vdf_read.h"
+#include "vdf_uring.h"
+
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* A minimal io_uring, used straight through the system calls so that libvdf doesn't need
+   liburing. Each vdf_read_ctx created with vdf_read_ctx_create() gets its own ring the
+   first time it reads from a real file, so no locking is needed. The reads of a plan are
+   submitted together and their completions are collected in whatever order the kernel
+   finishes them. */
+
+struct _vdf_uring {
+	int						fd;
+	unsigned int			*sq_head;
+	unsigned int			*sq_tail;
+	unsigned int			*sq_mask;
+	unsigned int			*sq_array;
+	struct io_uring_sqe		*sqes;
+	unsigned int			*cq_head;
+	unsigned int			*cq_tail;
+	unsigned int			*cq_mask;
+	struct io_uring_cqe		*cqes;
+	void					*sq_ring;
+	size_t					sq_ring_len;
+	void					*cq_ring;
+	size_t					cq_ring_len;
+	size_t					sqes_len;
+};
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+vdf_uring *uring_create(unsigned int entries) {
+	struct io_uring_params p;
+	vdf_uring *ring;
+	uint8_t *sq, *cq;
+
+	ring = malloc(sizeof(vdf_uring));
+	if(ring == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(ring, 0, sizeof(vdf_uring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_setup(entries, &p);
+	if(ring->fd == -1) {
+		free(ring);
+		return NULL;
+	}
+	ring->sq_ring_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	ring->cq_ring_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_ring_len > ring->sq_ring_len)
+			ring->sq_ring_len = ring->cq_ring_len;
+		ring->cq_ring_len = 0;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED)
+		goto fail;
+	if(ring->cq_ring_len == 0) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto fail;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int*)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return ring;
+
+fail:
+	if(ring->sq_ring == MAP_FAILED)
+		ring->sq_ring = NULL;
+	uring_free(ring);
+	return NULL;
+}
+
+void uring_free(vdf_uring *ring) {
+	if(ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_len);
+	if((ring->cq_ring != NULL) && (ring->cq_ring != ring->sq_ring))
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if(ring->sq_ring != NULL)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	free(ring);
+}
+
+/* Queue a read for every RDO_FILE in 'ops' and hand them all to the kernel. Returns the
+   number of reads in flight, which must be collected with uring_wait(), or -1 if the ring
+   couldn't be used. Reads that weren't submitted are left with 'res' set to -EAGAIN. */
+int uring_submit(vdf_uring *ring, vdf_read_op *ops, int n) {
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	int i, r, queued = 0, submitted = 0;
+
+	tail = *ring->sq_tail;
+	for(i=0; i<n; i++) {
+		if(ops[i].type != RDO_FILE)
+			continue;
+		sqe = ring->sqes + (tail & *ring->sq_mask);
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = ops[i].fd;
+		sqe->off = ops[i].off;
+		sqe->addr = (uintptr_t)ops[i].dst;
+		sqe->len = ops[i].len;
+		sqe->user_data = i;
+		ops[i].res = -EAGAIN;
+		ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+		tail++;
+		queued++;
+	}
+	if(queued == 0)
+		return 0;
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	while(submitted < queued) {
+		r = sys_enter(ring->fd, queued - submitted, 0, 0);
+		if(r == -1) {
+			if(errno == EINTR)
+				continue;
+			/* take back what the kernel hasn't consumed, those reads keep res = -EAGAIN
+			   and are done by the caller */
+			__atomic_store_n(ring->sq_tail, tail - (queued - submitted), __ATOMIC_RELEASE);
+			return submitted == 0 ? -1 : submitted;
+		}
+		submitted += r;
+	}
+	return submitted;
+}
+
+/* Collect 'pending' completions, storing each read's result in its op's 'res'
+   (bytes read or -errno). */
+void uring_wait(vdf_uring *ring, vdf_read_op *ops, int pending) {
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *ring->cq_head;
+	while(pending != 0) {
+		if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			sys_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+		cqe = ring->cqes + (head & *ring->cq_mask);
+		ops[cqe->user_data].res = cqe->res;
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		pending--;
+	}
+}
+
+#endif /* USE_IO_URING */
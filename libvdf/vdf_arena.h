@@ -0,0 +1,41 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_ARENA_H
+#define __VDF_ARENA_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+#include "list.h"
+
+#define ARENA_STR_ALIGN		16					/* string blocks are multiples of this */
+#define ARENA_STR_MAX		256					/* longer strings (with the terminator) get a block of their own */
+#define ARENA_STR_CLASSES	(ARENA_STR_MAX / ARENA_STR_ALIGN)
+
+typedef struct _vdf_chunk {
+	list_head		list;						/* drive chunk list, newest first */
+	size_t			size;						/* bytes, including this header */
+} vdf_chunk;
+
+extern void arena_init(vdf_drive *drv);
+extern void arena_free(vdf_drive *drv);
+extern vdf_file *arena_file_alloc(vdf_drive *drv);
+extern void arena_file_release(vdf_drive *drv, vdf_file *file);
+extern char *arena_strdup(vdf_drive *drv, const char *s);
+extern void arena_strfree(vdf_drive *drv, char *s);
+
+#endif /* __VDF_ARENA_H */
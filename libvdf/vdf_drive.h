@@ -21,20 +21,43 @@
 #include <vdf.h>
 #include "vdf_private.h"
 #include "list.h"
+#include "vdf_thread.h"
+#include "vdf_arena.h"
 
 #define VDF_DIRTY			0x10000
 #define VDF_DELETED			0x20000
+#define VDF_RECALC_ALL		0x80000		/* next recalculation redoes every directory and the whole layout */
 
 #define DEFAULT_DRIVE_SERIAL	0x12345678
+#define DEFAULT_READAHEAD		MiB(2)
 
+/* What the read path needs to know about a file, kept together so that serving a sector
+   touches the ranges rather than the files. The file itself is only looked at to produce
+   its data. */
 typedef struct _vdf_filerange {
 	sector_t		sectstart;					/* sector start */
 	sector_t		sectend;					/* sector end */
 	cluster_t		fatstart;					/* FAT index start */
 	cluster_t		fatend;						/* FAT index end */
+	sector_t		sectdata;					/* end of the sectors holding data, the rest read as zeros */
+	filesz_t		size;						/* file size (not used for directories) */
+	int				type;						/* how the data is read, one of RDO_* */
 	vdf_file		*file;
 } vdf_filerange;
 
+typedef struct _vdf_rangeindex {
+	int				cnt;						/* number of ranges indexed */
+	int				size;						/* number of positions allocated */
+	sector_t		*sectend;					/* range end sectors, Eytzinger order (1 based) */
+	cluster_t		*fatend;					/* range end FAT indexes, Eytzinger order (1 based) */
+	int				*rank;						/* range index for each Eytzinger position */
+} vdf_rangeindex;
+
+typedef struct _vdf_zerospan {
+	sector_t		start;						/* first sector that always reads as zeros */
+	sector_t		end;						/* sector after the last one */
+} vdf_zerospan;
+
 #ifdef ENABLE_CLUSTER_LIST
 
 typedef struct _vdf_filecluster {
@@ -57,6 +80,8 @@ struct _vdf_drive {
 	sectcnt_t		sectors;					/* total number of sectors (not including any MBR sectors) */
 	clustcnt_t		clusters;					/* total number of data clusters */
 	drivesz_t		bytes;						/* total number of bytes (including MBR if applicable) */
+	drivesz_t		headroom;					/* free space VDF_AUTO_SIZE leaves, in bytes */
+	vcd_driveext	ext;						/* parameters the drive was created with, for VDF_AUTO_SIZE */
 	vdf_file		*root_dir;					/* root directory */
 	int				root_dir_cnt;				/* count of root directory entries (ignored for FAT32) */
 	list_head		all_files;					/* full file/dir linked list */
@@ -64,17 +89,62 @@ struct _vdf_drive {
 	int				file_cnt;					/* total file/dir count */
 	int				nonempty_file_cnt;			/* total non-empty-file/dir count */
 	vdf_filerange	*ranges;					/* file/dir range list */
+	int				range_cnt;					/* number of entries in ranges */
+	int				range_size;					/* number of entries allocated for ranges */
+	int				relayout;					/* first range the next recalculation lays out again */
+	list_head		dirty_dirs;					/* directories changed since the last recalculation */
+	unsigned int	next_seq;					/* vdf_file.seq for the next file created */
+	unsigned int	recalc_seq;					/* next_seq at the last recalculation */
+	vdf_rangeindex	index;						/* lookup index over ranges */
+	vdf_zerospan	*zeros;						/* sectors known to be zero, sorted (NULL if none) */
+	int				zero_cnt;					/* number of entries in zeros */
+	int				zero_size;					/* number of entries allocated for zeros */
+	unsigned int	epoch;						/* bumped whenever the layout may change, see vdf_read_ctx */
 #ifdef ENABLE_CLUSTER_LIST
 	vdf_filecluster	*fileclusters;				/* cluster definition list (only used when writing is enabled) */
 #endif
+	list_head		fd_lru;						/* cached real file descriptors, most recently used first */
+	int				fd_cnt;						/* number of cached descriptors */
+	int				fd_max;						/* maximum number of cached descriptors (0 disables caching) */
+	vdf_mutex		fd_lock;					/* protects the descriptor cache */
+	int				map_cnt;					/* number of real files mapped */
+	int				mmap_file_cnt;				/* number of real files added with VAF_MMAP */
+	filesz_t		ra_max;						/* largest readahead window (0 disables readahead) */
+	uint32_t		req_id;						/* last vdf_file_request id handed out */
+	vdf_mutex		req_lock;					/* protects req_id */
+	struct _vdf_metasect **mc_hash;				/* cached metadata sectors, hashed by sector (NULL when empty) */
+	unsigned int	mc_hash_mask;				/* number of hash buckets - 1 */
+	list_head		mc_lru;						/* cached metadata sectors, most recently used first */
+	size_t			mc_cnt;						/* number of cached sectors */
+	size_t			mc_max;						/* memory limit for the metadata cache in bytes (0 disables it) */
+	unsigned int	mc_epoch;					/* drv->epoch the cached sectors were generated for */
+	uint64_t		mc_hits;					/* sectors served from the cache */
+	uint64_t		mc_misses;					/* sectors that had to be generated */
+	vdf_mutex		mc_lock;					/* protects the metadata cache */
+	struct _vdf_pathent *pc_ents;				/* resolved paths, PATH_CACHE_SLOTS of them (NULL until first used) */
+	unsigned int	pc_epoch;					/* entries made before this changed are stale */
+	vdf_mutex		pc_lock;					/* protects the path cache */
+	list_head		node_chunks;				/* blocks file nodes are carved from */
+	vdf_file		*node_pos;					/* next unused node in the newest block */
+	int				node_left;					/* number of unused nodes from node_pos on */
+	vdf_file		*node_free;					/* released nodes, chained through 'parent' */
+	size_t			node_bytes;					/* bytes held in node_chunks */
+	list_head		str_chunks;					/* blocks names and paths are carved from */
+	list_head		str_long;					/* blocks holding one string too long for str_chunks */
+	char			*str_pos;					/* unused space in the newest block */
+	size_t			str_left;					/* number of unused bytes from str_pos on */
+	char			*str_free[ARENA_STR_CLASSES];	/* released string blocks by size */
+	size_t			str_bytes;					/* bytes held in str_chunks and str_long */
+	list_head		all_dirs;					/* every directory, including the root */
 	char			*label;						/* label or NULL */
 	uint32_t		serial;						/* drive serial */
 
 	sectcnt_t		mbr_sectors;				/* number of sectors before partition start */
 	int				dirent_per_sector;			/* number of directory entries per sector */
 	sectcnt_t		fat_sectors;				/* number of sectors per FAT */
+	int				fat_cnt;					/* number of copies of the FAT (1 or 2) */
 	sector_t		fat1_start;					/* first sector of FAT 1 */
-	sector_t		fat2_start;					/* first sector of FAT 2 */
+	sector_t		fat2_start;					/* first sector of FAT 2 (same as root_start if fat_cnt is 1) */
 	sector_t		root_start;					/* first sector of root directory (ignored for FAT32) */
 	sectcnt_t		root_sectors;				/* number of sectors for root directory (ignored for FAT32) */
 	sector_t		data_start;					/* first sector of data */
@@ -83,6 +153,16 @@ struct _vdf_drive {
 };
 
 extern void set_drive_dirty(vdf_drive *drv);
+extern int range_index_build(vdf_drive *drv);
+extern void range_index_free(vdf_rangeindex *ind);
+extern int range_find_sector(vdf_drive *drv, sector_t sector);
+extern int range_find_cluster(vdf_drive *drv, cluster_t clust);
+extern int range_find_sector_from(vdf_drive *drv, sector_t sector, int hint);
+extern int range_find_cluster_from(vdf_drive *drv, cluster_t clust, int hint);
+extern int zeromap_build(vdf_drive *drv);
+extern void zeromap_free(vdf_drive *drv);
+extern int zeromap_find(vdf_drive *drv, sector_t sector);
+extern int zeromap_find_from(vdf_drive *drv, sector_t sector, int hint);
 
 static INLINE int drive_is_valid(vdf_drive *drv) {
 	return (drv != NULL) && !(drv->flags & VDF_DELETED);
@@ -0,0 +1,30 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_FATGEN_H
+#define __VDF_FATGEN_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+
+/* Fill 'cnt' FAT entries at 'dst' with first, first + 1, first + 2, ... */
+extern void fat_fill16(uint8_t *dst, cluster_t first, size_t cnt);
+extern void fat_fill32(uint8_t *dst, cluster_t first, size_t cnt);
+/* Fill 'pairs' three byte FAT12 groups, two entries each, starting with entry value 'first' */
+extern void fat_fill12(uint8_t *dst, cluster_t first, size_t pairs);
+
+#endif /* __VDF_FATGEN_H */
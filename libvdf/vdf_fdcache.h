@@ -0,0 +1,34 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_FDCACHE_H
+#define __VDF_FDCACHE_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+
+#define DEFAULT_FD_CACHE_SIZE	32
+
+extern void fdcache_init(vdf_drive *drv);
+extern void fdcache_free(vdf_drive *drv);
+extern void fdcache_flush(vdf_drive *drv);
+extern int fdcache_get(vdf_file *file);
+extern void fdcache_put(vdf_file *file, int fd);
+extern void fdcache_close(vdf_file *file);
+extern ssize_t file_pread(int fd, void *buffer, size_t cnt, fileoff_t off);
+
+#endif /* __VDF_FDCACHE_H */
@@ -26,20 +26,44 @@
 #define VFF_LONGNAME	0x04				/* signifies that the long name is not an 8.3 name */
 #define VFF_DELETED		0x08				/* structure is invalid */
 #define VFF_PENDINGDEL	0x10				/* pending deletion */
+#define VFF_MMAP		0x20				/* map real file into memory while locked */
+#define VFF_READAHEAD	0x40				/* send vfc_readahead hints to virtual file */
+#define VFF_ASYNC		0x80				/* virtual file uses the asynchronous callback */
+#define VFF_RECOUNT		0x100				/* directory entries need counting again, see dir_set_dirty() */
+#define VFF_REENCODE	0x200				/* directory needs encoding again */
+#define VFF_REINDEX		0x400				/* directory index is out of date */
 
 #define VFA_VOLLABEL	0x08
 #define VFA_USER_ATTR	(VFA_READONLY | VFA_HIDDEN | VFA_SYSTEM | VFA_ATTRIBUTE)	/* attributes the user can change */
 
+typedef struct _vdf_tail_family vdf_tail_family;
+
+/* short names in one directory that share a basis, see tail_alloc() */
+struct _vdf_tail_family {
+	vdf_tail_family	*next;					/* hash chain */
+	uint32_t		hash;					/* hash of 'key' */
+	int				next_tail;				/* lowest tail not yet handed out */
+	int				*free;					/* min heap of tails given back */
+	int				free_cnt;
+	int				free_size;
+	char			key[16];				/* basis left in front of the '~', tail width, extension */
+};
+
 struct _vdf_file {
 	vdf_drive		*drv;					/* drive that file belongs to */
 	char			*name;					/* long name */
 	char			shortname[13];			/* short name */
+	uint8_t			dosname[11];			/* short name as stored in a directory entry, space padded */
+	uint8_t			chk;					/* LFN checksum of dosname */
 	int				flags;					/* flags */
 	int				attr;					/* attributes */
 	vdf_file		*parent;				/* parent (containing dir) */
 	list_head		dirlist;				/* parents linked list */
 	list_head		alllist;				/* all files/dirs linked list */
 	time_t			date;					/* datetime */
+	uint16_t		fat_time;				/* 'date' as stored in a directory entry (little endian) */
+	uint16_t		fat_date;
+	uint8_t			fat_time_10ms;
 	filesz_t		size;					/* size in bytes */
 	sectcnt_t		clusters;				/* size in clusters */
 	sfilesz_t		fatsize;				/* size in bytes for FAT or -1 */
@@ -50,31 +74,75 @@ struct _vdf_file {
 	sector_t		endsect;				/* end sector */
 	int				fent_start;				/* start file entry (from directory start) */
 	int				fent_cnt;				/* number of _extra_ file entries */
+	unsigned int	seq;					/* creation order, the same as drv->all_files */
+	int				range_ind;				/* index in drv->ranges at the last recalculation or -1 */
+	int				dir_ind;				/* position in the parent's entry list, valid with the parent's index */
+	uint32_t		name_hash;				/* case folded hashes of 'name' and 'shortname' */
+	uint32_t		short_hash;
+	vdf_file		*name_next;				/* next in the parent's hash chains */
+	vdf_file		*short_next;
+	vdf_tail_family	*tail_fam;				/* family 'tail' was taken from or NULL */
+	int				tail;					/* numeric tail in 'shortname' */
 	union {
 		struct _vdf_file_real {
 			char		*path;					/* source path */
+			int			fd;						/* cached descriptor or -1 */
+			int			fd_ref;					/* number of readers using fd */
+			list_head	fd_lru;					/* drive descriptor cache list */
+			void		*map;					/* mapping of the file or NULL */
+			filesz_t	map_len;				/* length of 'map' */
 		} real;
 		struct _vdf_file_virt {
 			vdf_file_callback	cback;		/* callback */
+			vdf_file_async_callback acback;	/* callback for VFF_ASYNC files */
 			void	*param;
 		} virt;
 		struct _vdf_dir {
 			list_head	entries;			/* file/dir entry linked list */
 			int			cnt;				/* entry count */
 			int			fent_cnt;			/* number of file entries */
+			list_head	alldirs;			/* drv->all_dirs link */
+			list_head	dirty;				/* drv->dirty_dirs link, while VFF_RECOUNT or VFF_REENCODE is set */
+			uint8_t		*blob;				/* encoded entries for VDF_DIR_BLOBS or NULL, whole sectors */
+			size_t		blob_len;			/* length of 'blob' in bytes */
+			vdf_file	**index;			/* entries in list order or NULL, see dir_index_get() */
+			int			index_size;			/* number of pointers allocated for 'index' */
+			vdf_file	**name_tab;			/* entries hashed by long name or NULL, see dir_hash_reserve() */
+			vdf_file	**short_tab;		/* entries hashed by short name, in the same allocation */
+			int			tab_size;			/* number of buckets in each table, a power of two */
+			vdf_tail_family **fam_tab;		/* numeric tail families by key or NULL */
+			int			fam_size;			/* number of buckets in 'fam_tab', a power of two */
+			int			fam_cnt;			/* number of families */
 		} dir;
 	};
 };
 
 extern vdf_file *create_root_dir(vdf_drive *drv);
 extern int delete_file(vdf_file *file);
+extern void dir_free_tables(vdf_file *dir);
+extern size_t dir_footprint(vdf_file *dir);
 extern int stuff_dosname(char **d, char s);
-extern int dir_recalc(vdf_file *file);
+extern int name_is_short(const char *name);
+extern void dir_hash_reserve(vdf_file *dir, int cnt);
+extern vdf_file *file_add_real(vdf_file *parent, const char *name, const char *path, filesz_t size, time_t date, int flags);
+extern void dir_set_dirty(vdf_file *dir, int what);
+extern void file_entry_changed(vdf_file *file);
+extern void file_relayout(vdf_file *file);
+extern void dir_recount(vdf_file *dir);
 extern int file_recalc_dir(vdf_file *file);
+extern void file_recalc_clusters(vdf_file *file);
 extern int file_recalc_offsize(vdf_file *file);
+extern int dir_index_build(vdf_file *dir);
+extern vdf_file **dir_index_get(vdf_file *dir);
+extern vdf_file *dir_index_find(vdf_file *dir, int ent);
 
 static INLINE int file_is_valid(vdf_file *fil) {
 	return (fil != NULL) && !(fil->flags & VFF_DELETED);
 }
 
+/* the directory's index is up to date. it is never rebuilt while the drive is locked */
+static INLINE int dir_index_valid(vdf_file *dir) {
+	return (dir->dir.index != NULL) && !(dir->flags & VFF_REINDEX);
+}
+
 #endif /* __VDF_FILE_H */
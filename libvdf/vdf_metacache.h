@@ -0,0 +1,34 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_METACACHE_H
+#define __VDF_METACACHE_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+
+#define DEFAULT_META_CACHE_SIZE	MiB(1)
+
+/* generates 'cnt' uncached sectors starting at partition sector 'sector' */
+typedef int (*meta_fill_func)(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buffer, void *arg);
+
+extern void metacache_init(vdf_drive *drv);
+extern void metacache_free(vdf_drive *drv);
+extern void metacache_flush(vdf_drive *drv);
+extern int metacache_read(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, uint8_t *buffer, meta_fill_func fill, void *arg);
+
+#endif /* __VDF_METACACHE_H */
@@ -0,0 +1,28 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_MMAP_H
+#define __VDF_MMAP_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+
+extern void drive_map_files(vdf_drive *drv);
+extern void drive_unmap_files(vdf_drive *drv);
+extern void file_unmap(vdf_file *file);
+
+#endif /* __VDF_MMAP_H */
@@ -0,0 +1,32 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_PATHCACHE_H
+#define __VDF_PATHCACHE_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+
+#define PATH_CACHE_SLOTS	4096				/* must be a power of two */
+
+extern void pathcache_init(vdf_drive *drv);
+extern void pathcache_free(vdf_drive *drv);
+extern void pathcache_flush(vdf_drive *drv);
+extern vdf_file *pathcache_find(vdf_drive *drv, vdf_file *dir, const char *path, int flags);
+extern void pathcache_add(vdf_drive *drv, vdf_file *dir, const char *path, int flags, vdf_file *file);
+
+#endif /* __VDF_PATHCACHE_H */
@@ -18,8 +18,6 @@
 #ifndef __VDF_PRIVATE_H
 #define __VDF_PRIVATE_H
 
-#define WRITE_DEBUG		/* TODO: should be in config.h */
-
 #ifdef _MSC_VER
 #define INLINE		_inline
 #else
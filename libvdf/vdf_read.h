@@ -18,15 +18,130 @@
 #ifndef __VDF_READ_H
 #define __VDF_READ_H
 
+#include <string.h>
 #include <vdf.h>
 #include "vdf_private.h"
+#include "vdf_drive.h"
+
+#define RA_STREAMS		4					/* sequential streams tracked per context */
+#define RA_MIN_WINDOW	KiB(128)			/* first readahead issued for a stream */
+
+/* A file that a client is reading through. 'window' doubles each time the client catches
+   up with half of what has been read ahead and shrinks when the client jumps elsewhere. */
+typedef struct _vdf_ra_stream {
+	vdf_file		*file;						/* file being read or NULL */
+	fileoff_t		next;						/* where a sequential read would start */
+	fileoff_t		issued;						/* readahead has been requested up to here */
+	filesz_t		window;						/* current readahead window */
+	unsigned int	used;						/* ra_clock at last use, for replacement */
+} vdf_ra_stream;
+
+#define RCF_ASYNC		0x01			/* long lived context, may set up asynchronous I/O */
+#define RCF_NO_ASYNC	0x02			/* asynchronous I/O isn't available */
+
+#ifdef USE_IO_URING
+typedef struct _vdf_uring vdf_uring;
+#endif
+struct _async_wait;
+
+/* called once a deferred read is complete, 'err' is 0 or an errno */
+typedef void (*read_done_func)(void *priv, int err);
+
+/* Where the previous read left off. A read that carries on from there can pick up the
+   range and directory entry it needs without searching for them. Everything in here is
+   only a hint and is thrown away whenever the drive's epoch changes. */
+struct _vdf_read_ctx {
+	vdf_drive		*drv;
+	unsigned int	epoch;						/* drv->epoch the hints below are valid for */
+	int				data_range;					/* range of the last data sector read or -1 */
+	int				fat_range;					/* range of the last FAT entry generated or -1 */
+	int				zero_span;					/* zero map span found by the last read or -1 */
+	vdf_file		*dir;						/* directory last read or NULL */
+	vdf_file		*dir_fil;					/* last entry generated for 'dir' */
+	vdf_ra_stream	ra[RA_STREAMS];				/* readahead state */
+	unsigned int	ra_clock;
+	int				flags;						/* RCF_* */
+	struct _async_wait *defer;					/* deferred read in progress or NULL */
+#ifdef USE_IO_URING
+	vdf_uring		*ring;						/* submits real file reads, created on first use */
+#endif
+};
+
+static INLINE void read_ctx_reset(vdf_read_ctx *ctx) {
+	ctx->epoch = ctx->drv->epoch;
+	ctx->data_range = -1;
+	ctx->fat_range = -1;
+	ctx->zero_span = -1;
+	ctx->dir = NULL;
+	ctx->dir_fil = NULL;
+	memset(ctx->ra, 0, sizeof(ctx->ra));
+	ctx->ra_clock = 0;
+}
+
+static INLINE void read_ctx_init(vdf_read_ctx *ctx, vdf_drive *drv) {
+	ctx->drv = drv;
+	ctx->flags = 0;
+	ctx->defer = NULL;
+#ifdef USE_IO_URING
+	ctx->ring = NULL;
+#endif
+	read_ctx_reset(ctx);
+}
+
+/* Read operation types */
+#define RDO_ZERO		0x01			/* nothing to read, just padding */
+#define RDO_DIR			0x02			/* 'len' directory sectors starting at partition sector 'off' */
+#define RDO_VIRT		0x03			/* virtual file callback */
+#define RDO_MEM			0x04			/* copy from a mapped real file */
+#define RDO_FILE		0x05			/* read from a real file's descriptor */
+#define RDO_ASYNC		0x06			/* request from an asynchronous virtual file's provider */
+
+#define PLAN_OPS		32				/* operations planned before a batch is carried out */
+
+/* One piece of a planned data area read. 'len' bytes of the source go to 'dst',
+   followed by 'pad' zero bytes. */
+typedef struct _vdf_read_op {
+	int				type;						/* one of RDO_* */
+	vdf_file		*file;
+	fileoff_t		off;						/* offset in the file */
+	size_t			len;						/* bytes to read from the file */
+	size_t			pad;						/* zero bytes after the data */
+	uint8_t			*dst;
+	int				fd;							/* descriptor while an RDO_FILE is being carried out */
+	ssize_t			res;						/* result of an asynchronous read, bytes or -errno */
+} vdf_read_op;
+
+/* Extent types */
+#define VXT_BUFFER		0x01			/* generated data, read it with vdf_read_bytes_ctx() */
+#define VXT_FILE		0x02			/* data read straight from 'fd' at 'off' */
+#define VXT_MEM			0x03			/* data is at 'ptr' (a mapped real file) */
+#define VXT_ZERO		0x04			/* all zeros (eg. cluster slack or unused FAT sectors) */
+
+/* A run of drive bytes that can all be served the same way. Transports use these to hand
+   real file data to the kernel (eg. sendfile()) instead of copying it through a buffer. */
+typedef struct _vdf_extent {
+	int				type;						/* one of VXT_* */
+	drivesz_t		len;						/* length in bytes */
+	vdf_file		*file;						/* VXT_FILE/VXT_MEM: file the data comes from */
+	int				fd;							/* VXT_FILE: descriptor for 'file', release with read_extent_put() */
+	fileoff_t		off;						/* VXT_FILE/VXT_MEM: offset in 'file' */
+	const void		*ptr;						/* VXT_MEM: the data */
+} vdf_extent;
+
+extern void file_readahead(vdf_read_ctx *ctx, vdf_file *fil, fileoff_t off, filesz_t len, int fd);
+extern int read_extent(vdf_read_ctx *ctx, driveoff_t off, drivesz_t len, vdf_extent *ext);
+extern void read_extent_put(vdf_extent *ext);
+extern int read_range_async(vdf_read_ctx *ctx, driveoff_t off, drivesz_t len);
+extern int read_sectors_deferred(vdf_read_ctx *ctx, sector_t sector, sectcnt_t cnt, void *buffer, read_done_func done, void *priv);
 
 extern int read_sector_mbr(vdf_drive *drv, uint8_t *buffer);
 extern int read_sector_boot(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
-extern int read_sector_fat(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
+extern int read_sector_fat(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
 extern int read_sector_fat_clustlist(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
-extern int read_sector_dir(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer, vdf_file *dir);
-extern int read_sector_data(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
+extern int read_sector_dir(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer, vdf_file *dir);
+extern int dir_blob_build(vdf_drive *drv, vdf_read_ctx *ctx, vdf_file *dir);
+extern void dir_blob_free(vdf_file *dir);
+extern int read_sector_data(vdf_drive *drv, vdf_read_ctx *ctx, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
 extern int read_sector_data_clustlist(vdf_drive *drv, sector_t sector, sectcnt_t scnt, uint8_t *buffer);
 
 #endif /* __VDF_READ_H */
@@ -30,8 +30,15 @@
 #endif
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
 #include <vdf.h>
 #include "vdf_sock.h"
+#include "vdf_drive.h"
+#include "vdf_read.h"
 
 #ifdef _WIN32
 #define SEND_FLAGS		0
@@ -45,7 +52,7 @@ int sock_write(vdf_sock sock, void *buff, size_t cnt) {
 	uint8_t *b = (uint8_t*)buff;
 	int wrote, total = 0;
 	while(total < cnt) {
-		wrote = send(sock, b, cnt, SEND_FLAGS);
+		wrote = send(sock, b, cnt - total, SEND_FLAGS);
 		if(wrote == 0)
 #if 1
 			return -1;		/* is this an error? */
@@ -64,7 +71,7 @@ int sock_read(vdf_sock sock, void *buff, size_t cnt) {
 	uint8_t *b = (uint8_t*)buff;
 	int read, total = 0;
 	while(total < cnt) {
-		read = recv(sock, b, cnt, RECV_FLAGS);
+		read = recv(sock, b, cnt - total, RECV_FLAGS);
 		if(read == 0)
 			break;
 		if(read == -1)
@@ -107,3 +114,101 @@ int sock_non_block(vdf_sock sock, int non_block) {
 #endif
 #endif
 }
+
+#ifdef USE_SENDFILE
+/* returns the number of bytes sent, which is only less than 'cnt' if the file got shorter */
+static sdrivesz_t sock_sendfile(vdf_sock sock, int fd, fileoff_t off, drivesz_t cnt) {
+	off_t foff = off;
+	sdrivesz_t total = 0;
+	ssize_t sent;
+
+	while(total < (sdrivesz_t)cnt) {
+		sent = sendfile(sock, fd, &foff, cnt - total);
+		if(sent == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(sent == 0)
+			break;
+		total += sent;
+	}
+	return total;
+}
+#endif
+
+static int sock_write_zeros(vdf_sock sock, drivesz_t len, void *buff, size_t bufflen) {
+	size_t cnt;
+
+	memset(buff, 0, (len < bufflen) ? len : bufflen);
+	while(len > 0) {
+		cnt = (len < bufflen) ? len : bufflen;
+		if(sock_write(sock, buff, cnt) == -1)
+			return -1;
+		len -= cnt;
+	}
+	return 0;
+}
+
+/* Write 'len' bytes of the drive starting at 'off' to 'sock'. Data from mapped real files is
+   sent straight from the mapping and, where sendfile() is available, data from other real
+   files is sent without going through 'buff'. Known zero sectors are never generated. */
+int sock_write_drive(vdf_sock sock, vdf_read_ctx *ctx, driveoff_t off, drivesz_t len, void *buff, size_t bufflen) {
+	vdf_extent ext;
+	drivesz_t want;
+	size_t cnt;
+#ifdef USE_SENDFILE
+	sdrivesz_t sent;
+#endif
+
+	while(len > 0) {
+		if(read_extent(ctx, off, len, &ext) == -1)
+			return -1;
+		if(ext.type == VXT_MEM) {
+			if(sock_write(sock, (void*)ext.ptr, ext.len) == -1)
+				return -1;
+			off += ext.len;
+			len -= ext.len;
+			continue;
+		}
+		if(ext.type == VXT_ZERO) {
+			if(sock_write_zeros(sock, ext.len, buff, bufflen) == -1)
+				return -1;
+			off += ext.len;
+			len -= ext.len;
+			continue;
+		}
+#ifdef USE_SENDFILE
+		if(ext.type == VXT_FILE) {
+			sent = sock_sendfile(sock, ext.fd, ext.off, ext.len);
+			read_extent_put(&ext);
+			if(sent == -1)
+				return -1;
+			off += sent;
+			len -= sent;
+			if((drivesz_t)sent == ext.len)
+				continue;
+			/* file is shorter than it was when the drive was locked, the rest reads as zeros */
+			want = ext.len - sent;
+			if(sock_write_zeros(sock, want, buff, bufflen) == -1)
+				return -1;
+			off += want;
+			len -= want;
+			continue;
+		}
+#endif
+		read_extent_put(&ext);
+		want = ext.len;
+		while(want > 0) {
+			cnt = (want < bufflen) ? want : bufflen;
+			if(vdf_read_bytes_ctx(ctx, off, cnt, buff) == -1)
+				return -1;
+			if(sock_write(sock, buff, cnt) == -1)
+				return -1;
+			want -= cnt;
+			off += cnt;
+			len -= cnt;
+		}
+	}
+	return 0;
+}
@@ -29,6 +29,7 @@
 #include <netdb.h>
 #include <netinet/tcp.h>
 #endif
+#include <vdf.h>
 #include "vdf_private.h"
 
 #ifdef _WIN32
@@ -44,6 +45,7 @@ extern int sock_write(vdf_sock sock, void *buff, size_t cnt);
 extern int sock_read(vdf_sock sock, void *buff, size_t cnt);
 extern int sock_close(vdf_sock sock);
 extern int sock_non_block(vdf_sock sock, int non_block);
+extern int sock_write_drive(vdf_sock sock, vdf_read_ctx *ctx, driveoff_t off, drivesz_t len, void *buff, size_t bufflen);
 
 #if 0
 static INLINE uint64_t htonll(uint64_t val) {
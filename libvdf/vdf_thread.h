@@ -0,0 +1,112 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_THREAD_H
+#define __VDF_THREAD_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "vdf_private.h"
+
+/* Transports may serve several clients from separate threads, so any state
+   that is shared between reads of a locked drive must be protected by one of these */
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION	vdf_mutex;
+
+static INLINE void mutex_init(vdf_mutex *m) {
+	InitializeCriticalSection(m);
+}
+
+static INLINE void mutex_destroy(vdf_mutex *m) {
+	DeleteCriticalSection(m);
+}
+
+static INLINE void mutex_lock(vdf_mutex *m) {
+	EnterCriticalSection(m);
+}
+
+static INLINE void mutex_unlock(vdf_mutex *m) {
+	LeaveCriticalSection(m);
+}
+
+typedef CONDITION_VARIABLE	vdf_cond;
+
+static INLINE void cond_init(vdf_cond *c) {
+	InitializeConditionVariable(c);
+}
+
+static INLINE void cond_destroy(vdf_cond *c) {
+}
+
+static INLINE void cond_wait(vdf_cond *c, vdf_mutex *m) {
+	SleepConditionVariableCS(c, m, INFINITE);
+}
+
+static INLINE void cond_signal(vdf_cond *c) {
+	WakeConditionVariable(c);
+}
+
+static INLINE void cond_broadcast(vdf_cond *c) {
+	WakeAllConditionVariable(c);
+}
+#else
+typedef pthread_mutex_t		vdf_mutex;
+
+static INLINE void mutex_init(vdf_mutex *m) {
+	pthread_mutex_init(m, NULL);
+}
+
+static INLINE void mutex_destroy(vdf_mutex *m) {
+	pthread_mutex_destroy(m);
+}
+
+static INLINE void mutex_lock(vdf_mutex *m) {
+	pthread_mutex_lock(m);
+}
+
+static INLINE void mutex_unlock(vdf_mutex *m) {
+	pthread_mutex_unlock(m);
+}
+
+typedef pthread_cond_t		vdf_cond;
+
+static INLINE void cond_init(vdf_cond *c) {
+	pthread_cond_init(c, NULL);
+}
+
+static INLINE void cond_destroy(vdf_cond *c) {
+	pthread_cond_destroy(c);
+}
+
+static INLINE void cond_wait(vdf_cond *c, vdf_mutex *m) {
+	pthread_cond_wait(c, m);
+}
+
+static INLINE void cond_signal(vdf_cond *c) {
+	pthread_cond_signal(c);
+}
+
+static INLINE void cond_broadcast(vdf_cond *c) {
+	pthread_cond_broadcast(c);
+}
+#endif
+
+#endif /* __VDF_THREAD_H */
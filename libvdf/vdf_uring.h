@@ -0,0 +1,36 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDF_URING_H
+#define __VDF_URING_H
+
+#include <vdf.h>
+#include "vdf_private.h"
+#include "vdf_read.h"
+
+#ifdef USE_IO_URING
+
+#define URING_ENTRIES	PLAN_OPS
+
+extern vdf_uring *uring_create(unsigned int entries);
+extern void uring_free(vdf_uring *ring);
+extern int uring_submit(vdf_uring *ring, vdf_read_op *ops, int n);
+extern void uring_wait(vdf_uring *ring, vdf_read_op *ops, int pending);
+
+#endif /* USE_IO_URING */
+
+#endif /* __VDF_URING_H */
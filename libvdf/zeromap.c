@@ -0,0 +1,158 @@
+/*
+	Copyright (C) 2012 David Steinberg <doogle2600@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define LIBVDF_SRC
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vdf.h>
+#include "vdf_drive.h"
+#include "vdf_file.h"
+
+/*
+	Map of the partition sectors that always read as zeros.
+
+	Much of a drive is known to be empty before anything is generated: unused reserved
+	sectors, FAT entries past the last used cluster, directory slack, the cluster slack
+	after the end of each file and everything past the end of the data. The spans are
+	collected in sector order when the drive is recalculated, so the read path can clear
+	them in one go without asking any of the generators, and transports can skip them.
+	Sectors that are only partly zero are left to the generators.
+*/
+
+static void add_span(vdf_drive *drv, sector_t start, sector_t end) {
+	vdf_zerospan *z;
+
+	if(start >= end)
+		return;
+	if(drv->zero_cnt != 0) {
+		z = drv->zeros + drv->zero_cnt - 1;
+		if(z->end == start) {
+			z->end = end;
+			return;
+		}
+	}
+	z = drv->zeros + drv->zero_cnt++;
+	z->start = start;
+	z->end = end;
+}
+
+/* sectors of a FAT or directory that hold the first 'bytes' bytes */
+static INLINE sectcnt_t used_sectors(vdf_drive *drv, drivesz_t bytes) {
+	return (sectcnt_t)((bytes + drv->bps - 1) / drv->bps);
+}
+
+void zeromap_free(vdf_drive *drv) {
+	if(drv->zeros != NULL)
+		free(drv->zeros);
+	drv->zeros = NULL;
+	drv->zero_cnt = 0;
+	drv->zero_size = 0;
+}
+
+int zeromap_build(vdf_drive *drv) {
+	drivesz_t fat_bytes;
+	sectcnt_t used;
+	vdf_zerospan *z;
+	int i;
+
+	drv->zero_cnt = 0;
+#ifdef ENABLE_CLUSTER_LIST
+	/* anything can be written to */
+	if(drv->flags & VDF_CLUSTERLIST)
+		return 0;
+#endif
+	/* reserved, both FATs, the root directory, one per range and the end of the data.
+	   the array is kept between recalculations */
+	if(drv->zero_size < (drv->range_cnt + 8)) {
+		i = drv->range_cnt + (drv->range_cnt / 8) + 8;
+		z = realloc(drv->zeros, sizeof(vdf_zerospan) * i);
+		if(z == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		drv->zeros = z;
+		drv->zero_size = i;
+	}
+
+	if(drv->filesys == VDF_FAT32) {
+		/* boot sector, FS info sector and backup boot sector */
+		add_span(drv, 2, 6);
+		add_span(drv, 7, drv->fat1_start);
+	} else
+		add_span(drv, 1, drv->fat1_start);
+
+	fat_bytes = drv->data_cluster_end;
+	switch(drv->filesys) {
+		case VDF_FAT12:
+			fat_bytes = ((fat_bytes * 3) + 1) / 2;
+			break;
+		case VDF_FAT16:
+			fat_bytes *= 2;
+			break;
+		case VDF_FAT32:
+			fat_bytes *= 4;
+			break;
+	}
+	used = used_sectors(drv, fat_bytes);
+	add_span(drv, drv->fat1_start + used, drv->fat1_start + drv->fat_sectors);
+	if(drv->fat_cnt > 1)
+		add_span(drv, drv->fat2_start + used, drv->fat2_start + drv->fat_sectors);
+
+	if(drv->filesys != VDF_FAT32) {
+		used = used_sectors(drv, drv->root_dir->size);
+		add_span(drv, drv->root_start + used, drv->root_start + drv->root_sectors);
+	}
+
+	/* the ranges are in sector order, and a directory's size covers its entries */
+	for(i=0; i<drv->range_cnt; i++)
+		add_span(drv, drv->ranges[i].sectdata, drv->ranges[i].sectend);
+
+	add_span(drv, drv->data_end, drv->sectors);
+	return 0;
+}
+
+/* Index of the first span that ends after 'sector', or zero_cnt if there isn't one */
+int zeromap_find(vdf_drive *drv, sector_t sector) {
+	int lo = 0, hi = drv->zero_cnt, mid;
+
+	while(lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if(drv->zeros[mid].end > sector)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* zeromap_find(), trying 'hint' (the last answer) and the span after it first */
+int zeromap_find_from(vdf_drive *drv, sector_t sector, int hint) {
+	if((hint >= 0) && (hint <= drv->zero_cnt) && ((hint == 0) || (drv->zeros[hint - 1].end <= sector))) {
+		if((hint == drv->zero_cnt) || (drv->zeros[hint].end > sector))
+			return hint;
+		if((++hint == drv->zero_cnt) || (drv->zeros[hint].end > sector))
+			return hint;
+	}
+	return zeromap_find(drv, sector);
+}